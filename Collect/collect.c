@@ -1,7 +1,17 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "collect.h"
 
@@ -18,8 +28,1337 @@ void count_instruction(char *name){
   ++size;
 }
 
+/*
+  Only reached when the module was instrumented with -instrument-intrinsics
+  and -InstrumentLower did not run on it.
+*/
+void basilisk_increment(unsigned long long *counter, unsigned long long amount){
+  *counter += amount;
+}
+
+void register_lines(LineSite *sites, unsigned long long *counters, int n){
+  if (num_line_tables == MAX_MODULES){
+    printf("Too many modules, ignoring line counters\n");
+    return;
+  }
+
+  line_tables[num_line_tables].sites = sites;
+  line_tables[num_line_tables].counters = counters;
+  line_tables[num_line_tables].n = n;
+  ++num_line_tables;
+}
+
+void dump_lines(){
+  if (num_line_tables == 0)
+    return;
+
+  FILE *f;
+  f = fopen(LINES_FILENAME, "w");
+  if (f != NULL){
+
+    fprintf(f, "FILE,LINE,OPCODE,COUNT\n");
+    for (int t=0; t<num_line_tables; t++){
+      LineTable *table = &line_tables[t];
+      for (int i=0; i<table->n; i++){
+        if (table->counters[i] == 0)
+          continue;
+        fprintf(f, "%s,%d,%s,%llu\n", table->sites[i].file,
+                table->sites[i].line, table->sites[i].opcode,
+                table->counters[i]);
+      }
+    }
+
+    fclose(f);
+  }
+  else {
+    printf("Cannot create file\n");
+  }
+}
+
+void register_values(Site *sites, ValueProfile *profiles, int n){
+  if (num_value_tables == MAX_MODULES){
+    printf("Too many modules, ignoring value profiles\n");
+    return;
+  }
+
+  value_tables[num_value_tables].sites = sites;
+  value_tables[num_value_tables].profiles = profiles;
+  value_tables[num_value_tables].n = n;
+  ++num_value_tables;
+}
+
+void profile_value(ValueProfile *p, unsigned long long value){
+  __atomic_fetch_add(&p->total, 1, __ATOMIC_RELAXED);
+
+  int smallest = -1, empty = -1;
+  unsigned long long least = 0;
+  for (int i=0; i<VALUE_TOPK; i++){
+    unsigned char state = __atomic_load_n(&p->state[i], __ATOMIC_ACQUIRE);
+
+    if (state == 2){
+      if (p->values[i] == value){
+        __atomic_fetch_add(&p->counts[i], 1, __ATOMIC_RELAXED);
+        return;
+      }
+      unsigned long long count = __atomic_load_n(&p->counts[i],
+                                                 __ATOMIC_RELAXED);
+      if (smallest < 0 || count < least){
+        smallest = i;
+        least = count;
+      }
+    }
+    else if (state == 0 && empty < 0)
+      empty = i;
+  }
+
+  /*
+    Claim a free slot, or else evict the smallest one. A slot that another
+    thread holds is left alone and the execution goes to other.
+  */
+  int slot = empty >= 0 ? empty : smallest;
+  if (slot < 0)
+    return;
+
+  unsigned char expected = empty >= 0 ? 0 : 2;
+  if (!__atomic_compare_exchange_n(&p->state[slot], &expected, 1, 0,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+
+  p->values[slot] = value;
+  p->errors[slot] = __atomic_load_n(&p->counts[slot], __ATOMIC_RELAXED);
+  __atomic_fetch_add(&p->counts[slot], 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&p->state[slot], 2, __ATOMIC_RELEASE);
+}
+
+/*
+  The values of p with the executions known to have them, from the most
+  frequent; slots claimed twice for the same value are merged. Returns
+  the number of values.
+*/
+static int value_slots(ValueProfile *p, unsigned long long *values,
+                       unsigned long long *counts){
+  int used = 0;
+  for (int k=0; k<VALUE_TOPK; k++){
+    if (p->state[k] != 2 || p->counts[k] <= p->errors[k])
+      continue;
+    int j;
+    for (j=0; j<used && values[j] != p->values[k]; j++);
+    if (j == used){
+      values[used] = p->values[k];
+      counts[used++] = 0;
+    }
+    counts[j] += p->counts[k] - p->errors[k];
+  }
+
+  for (int a=0; a<used; a++){
+    for (int b=a+1; b<used; b++){
+      if (counts[b] > counts[a]){
+        unsigned long long tv = values[a], tc = counts[a];
+        values[a] = values[b]; counts[a] = counts[b];
+        values[b] = tv; counts[b] = tc;
+      }
+    }
+  }
+  return used;
+}
+
+/* Executions of the values not reported */
+static unsigned long long value_other(ValueProfile *p){
+  unsigned long long values[VALUE_TOPK], counts[VALUE_TOPK], known = 0;
+  int used = value_slots(p, values, counts);
+  for (int k=0; k<used; k++)
+    known += counts[k];
+  return p->total - known;
+}
+
+typedef struct ValueEntry{
+  Site *site;
+  ValueProfile *profile;
+} ValueEntry;
+
+static int compare_values(const void *a, const void *b){
+  unsigned long long ta = ((const ValueEntry*)a)->profile->total;
+  unsigned long long tb = ((const ValueEntry*)b)->profile->total;
+  return (ta < tb) - (ta > tb);
+}
+
+void dump_values(){
+  if (num_value_tables == 0)
+    return;
+
+  int n = 0;
+  for (int t=0; t<num_value_tables; t++)
+    n += value_tables[t].n;
+
+  ValueEntry *entries = malloc(n * sizeof(ValueEntry));
+  n = 0;
+  for (int t=0; t<num_value_tables; t++){
+    for (int i=0; i<value_tables[t].n; i++){
+      if (value_tables[t].profiles[i].total == 0)
+        continue;
+      entries[n].site = &value_tables[t].sites[i];
+      entries[n].profile = &value_tables[t].profiles[i];
+      ++n;
+    }
+  }
+
+  // Hottest sites first
+  qsort(entries, n, sizeof(ValueEntry), compare_values);
+
+  FILE *f;
+  f = fopen(VALUES_FILENAME, "w");
+  if (f != NULL){
+
+    fprintf(f, "FUNCTION,FILE,LINE,KIND,TOTAL");
+    for (int k=0; k<VALUE_TOPK; k++)
+      fprintf(f, ",VALUE%d,COUNT%d", k+1, k+1);
+    fprintf(f, ",OTHER,DOMINANT\n");
+
+    for (int i=0; i<n; i++){
+      Site *site = entries[i].site;
+      ValueProfile *p = entries[i].profile;
+
+      unsigned long long values[VALUE_TOPK], counts[VALUE_TOPK];
+      int used = value_slots(p, values, counts);
+
+      fprintf(f, "%s,%s,%d,%s,%llu", site->function, site->file, site->line,
+              site->kind, p->total);
+      for (int k=0; k<VALUE_TOPK; k++){
+        if (k < used)
+          fprintf(f, ",%llu,%llu", values[k], counts[k]);
+        else
+          fprintf(f, ",,");
+      }
+      fprintf(f, ",%llu,%d\n", value_other(p),
+              used > 0 && counts[0] >= DOMINANT_RATIO * p->total);
+    }
+
+    fclose(f);
+  }
+  else {
+    printf("Cannot create file\n");
+  }
+
+  free(entries);
+}
+
+void register_branches(BranchSite *sites, unsigned long long *counters, int n){
+  if (num_branch_tables == MAX_MODULES){
+    printf("Too many modules, ignoring branch counters\n");
+    return;
+  }
+
+  branch_tables[num_branch_tables].sites = sites;
+  branch_tables[num_branch_tables].counters = counters;
+  branch_tables[num_branch_tables].n = n;
+  ++num_branch_tables;
+}
+
+void dump_branches(){
+  if (num_branch_tables == 0)
+    return;
+
+  FILE *f;
+  f = fopen(BRANCHES_FILENAME, "w");
+  if (f != NULL){
+
+    /* Cold edges are kept, they matter for block layout */
+    fprintf(f, "FUNCTION,FILE,LINE,KIND,TARGET_LINE,FUNCTION_LINE,COUNT\n");
+    for (int t=0; t<num_branch_tables; t++){
+      BranchTable *table = &branch_tables[t];
+      for (int i=0; i<table->n; i++){
+        BranchSite *b = &table->sites[i];
+        fprintf(f, "%s,%s,%d,%s,%d,%d,%llu\n", b->site.function,
+                b->site.file, b->site.line, b->site.kind, b->target_line,
+                b->function_line, table->counters[i]);
+      }
+    }
+
+    fclose(f);
+  }
+  else {
+    printf("Cannot create file\n");
+  }
+}
+
+void register_calls(Site *sites, unsigned long long *counters, int n){
+  if (num_call_tables == MAX_MODULES){
+    printf("Too many modules, ignoring call counters\n");
+    return;
+  }
+
+  call_tables[num_call_tables].sites = sites;
+  call_tables[num_call_tables].counters = counters;
+  call_tables[num_call_tables].n = n;
+  ++num_call_tables;
+}
+
+void register_indirect_calls(Site *sites, ValueProfile *profiles, int n){
+  if (num_indirect_tables == MAX_MODULES){
+    printf("Too many modules, ignoring indirect calls\n");
+    return;
+  }
+
+  indirect_tables[num_indirect_tables].sites = sites;
+  indirect_tables[num_indirect_tables].profiles = profiles;
+  indirect_tables[num_indirect_tables].n = n;
+  ++num_indirect_tables;
+}
+
+/*
+  Static functions are only found by dladdr when the program is linked
+  with -rdynamic, otherwise the address is written
+*/
+static void print_target(FILE *f, unsigned long long address){
+  Dl_info info;
+  if (dladdr((void*)address, &info) && info.dli_sname != NULL)
+    fprintf(f, "%s", info.dli_sname);
+  else
+    fprintf(f, "0x%llx", address);
+}
+
+void dump_calls(){
+  if (num_call_tables == 0 && num_indirect_tables == 0)
+    return;
+
+  FILE *f;
+  f = fopen(CALLS_FILENAME, "w");
+  if (f != NULL){
+
+    fprintf(f, "KIND,CALLER,CALLEE,FILE,LINE,COUNT\n");
+    for (int t=0; t<num_call_tables; t++){
+      CallTable *table = &call_tables[t];
+      for (int i=0; i<table->n; i++){
+        if (table->counters[i] == 0)
+          continue;
+        Site *s = &table->sites[i];
+        fprintf(f, "direct,%s,%s,%s,%d,%llu\n", s->function, s->kind,
+                s->file, s->line, table->counters[i]);
+      }
+    }
+
+    /* One row per target; the calls beyond VALUE_TOPK targets are OTHER */
+    for (int t=0; t<num_indirect_tables; t++){
+      ValueTable *table = &indirect_tables[t];
+      for (int i=0; i<table->n; i++){
+        Site *s = &table->sites[i];
+        ValueProfile *p = &table->profiles[i];
+        unsigned long long values[VALUE_TOPK], counts[VALUE_TOPK];
+        int used = value_slots(p, values, counts);
+        for (int k=0; k<used; k++){
+          fprintf(f, "indirect,%s,", s->function);
+          print_target(f, values[k]);
+          fprintf(f, ",%s,%d,%llu\n", s->file, s->line, counts[k]);
+        }
+        if (value_other(p))
+          fprintf(f, "indirect,%s,OTHER,%s,%d,%llu\n", s->function, s->file,
+                  s->line, value_other(p));
+      }
+    }
+
+    fclose(f);
+  }
+  else {
+    printf("Cannot create file\n");
+  }
+}
+
+void register_strides(StrideSite *sites, StrideProfile *profiles, int n){
+  if (num_stride_tables == MAX_MODULES){
+    printf("Too many modules, ignoring stride profiles\n");
+    return;
+  }
+
+  stride_tables[num_stride_tables].sites = sites;
+  stride_tables[num_stride_tables].profiles = profiles;
+  stride_tables[num_stride_tables].n = n;
+  ++num_stride_tables;
+}
+
+void profile_stride(StrideProfile *p, void *address, long long size){
+  unsigned long long a = (unsigned long long)address;
+  unsigned long long last = __atomic_exchange_n(&p->last, a, __ATOMIC_RELAXED);
+
+  /* First access of the site, there is no distance yet */
+  if (last == 0)
+    return;
+
+  long long delta = (long long)(a - last);
+  long long stride = __atomic_exchange_n(&p->stride, delta, __ATOMIC_RELAXED);
+  int have_stride = __atomic_exchange_n(&p->have_stride, 1, __ATOMIC_RELAXED) != 0;
+
+  if (delta == size)
+    __atomic_add_fetch(&p->unit, 1, __ATOMIC_RELAXED);
+  else if (!have_stride)
+    return;
+  else if (delta == stride)
+    __atomic_add_fetch(&p->constant, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_add_fetch(&p->irregular, 1, __ATOMIC_RELAXED);
+}
+
+typedef struct StrideEntry{
+  StrideSite *site;
+  StrideProfile *profile;
+} StrideEntry;
+
+static int compare_strides(const void *a, const void *b){
+  unsigned long long ia = ((const StrideEntry*)a)->profile->irregular;
+  unsigned long long ib = ((const StrideEntry*)b)->profile->irregular;
+  return (ia < ib) - (ia > ib);
+}
+
+void dump_strides(){
+  if (num_stride_tables == 0)
+    return;
+
+  int n = 0;
+  for (int t=0; t<num_stride_tables; t++)
+    n += stride_tables[t].n;
+
+  StrideEntry *entries = malloc(n * sizeof(StrideEntry));
+  n = 0;
+  for (int t=0; t<num_stride_tables; t++){
+    for (int i=0; i<stride_tables[t].n; i++){
+      StrideProfile *p = &stride_tables[t].profiles[i];
+      if (!stride_tables[t].sites[i].is_static &&
+          p->unit + p->constant + p->irregular == 0)
+        continue;
+      entries[n].site = &stride_tables[t].sites[i];
+      entries[n].profile = p;
+      ++n;
+    }
+  }
+
+  /* The sites with most irregular accesses first */
+  qsort(entries, n, sizeof(StrideEntry), compare_strides);
+
+  FILE *f;
+  f = fopen(STRIDES_FILENAME, "w");
+  if (f != NULL){
+
+    fprintf(f, "FUNCTION,FILE,LINE,KIND,SIZE,STATIC,STRIDE,UNIT,CONSTANT,IRREGULAR\n");
+    for (int i=0; i<n; i++){
+      StrideSite *s = entries[i].site;
+      StrideProfile *p = entries[i].profile;
+
+      fprintf(f, "%s,%s,%d,%s,%d,%d,", s->site.function, s->site.file,
+              s->site.line, s->site.kind, s->size, s->is_static);
+      if (s->is_static)
+        fprintf(f, "%lld,,,\n", s->stride);
+      else
+        fprintf(f, ",%llu,%llu,%llu\n", p->unit, p->constant, p->irregular);
+    }
+
+    fclose(f);
+  }
+  else {
+    printf("Cannot create file\n");
+  }
+
+  free(entries);
+}
+
+/*
+  Shadow stack of -instrument-cycles. `children` are the cycles spent in
+  the callees, including the probes around them, and `probes` the number
+  of frames below this one, whose probe overhead is removed from the
+  inclusive time. Only the `outermost` activation of a function in the
+  stack adds its inclusive time, the recursive ones are part of it.
+*/
+typedef struct Frame{
+  FunctionCycles *record;
+  unsigned long long start;
+  unsigned long long children;
+  unsigned long long probes;
+  int outermost;
+} Frame;
+
+static __thread Frame frames[MAX_DEPTH];
+static __thread int depth = 0;
+
+/*
+  Activations in the shadow stack of each function, in an open-addressing
+  table of the thread, so that recursion is found without walking the
+  stack. Entries are never removed, only their count drops to 0.
+*/
+typedef struct Activation{
+  FunctionCycles *record;
+  int count;
+} Activation;
+
+static __thread Activation activations[ACTIVE_SLOTS];
+
+/* NULL when the table is full */
+static int* active_count(FunctionCycles *record){
+  unsigned long h = ((unsigned long)record >> 3) & (ACTIVE_SLOTS - 1);
+  for (int i=0; i<ACTIVE_SLOTS; i++, h = (h + 1) & (ACTIVE_SLOTS - 1)){
+    if (activations[h].record == record)
+      return &activations[h].count;
+    if (activations[h].record == NULL){
+      activations[h].record = record;
+      return &activations[h].count;
+    }
+  }
+  return NULL;
+}
+
+/*
+  `probe_inside` is the overhead that a probe pair adds to the function
+  it measures, `probe_outside` the one it adds to the caller
+*/
+static unsigned long long probe_inside = 0;
+static unsigned long long probe_outside = 0;
+
+static unsigned long long read_cycles(){
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static void calibrate_cycles(){
+  FunctionCycles dummy = {0, 0, 0};
+  unsigned long long outside = 0;
+
+  for (int i=0; i<CALIBRATION_ROUNDS; i++){
+    unsigned long long t = read_cycles();
+    cycles_enter(&dummy, read_cycles());
+    cycles_exit(&dummy, read_cycles());
+    outside += read_cycles() - t;
+  }
+
+  probe_inside = dummy.inclusive / CALIBRATION_ROUNDS;
+  probe_outside = outside / CALIBRATION_ROUNDS;
+}
+
+void register_cycles(Site *sites, FunctionCycles *cycles, int n){
+  if (num_cycle_tables == MAX_MODULES){
+    printf("Too many modules, ignoring cycle counters\n");
+    return;
+  }
+
+  if (num_cycle_tables == 0)
+    calibrate_cycles();
+
+  cycle_tables[num_cycle_tables].sites = sites;
+  cycle_tables[num_cycle_tables].cycles = cycles;
+  cycle_tables[num_cycle_tables].n = n;
+  ++num_cycle_tables;
+}
+
+void cycles_enter(FunctionCycles *record, unsigned long long now){
+  if (depth < MAX_DEPTH){
+    frames[depth].record = record;
+    frames[depth].start = now;
+    frames[depth].children = 0;
+    frames[depth].probes = 0;
+
+    int *active = active_count(record);
+    if (active)
+      frames[depth].outermost = (*active)++ == 0;
+    else {
+      int i;
+      for (i=0; i<depth && frames[i].record != record; i++);
+      frames[depth].outermost = i == depth;
+    }
+  }
+  ++depth;
+}
+
+static unsigned long long subtract(unsigned long long a, unsigned long long b){
+  return a > b ? a - b : 0;
+}
+
+static void pop_frame(unsigned long long now){
+  --depth;
+  if (depth >= MAX_DEPTH)
+    return;
+
+  Frame *f = &frames[depth];
+  unsigned long long elapsed = subtract(now - f->start, probe_inside);
+
+  __atomic_fetch_add(&f->record->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&f->record->exclusive,
+                     subtract(elapsed, f->children), __ATOMIC_RELAXED);
+
+  int *active = active_count(f->record);
+  if (active)
+    --*active;
+
+  /* Recursive calls are already part of the outermost activation */
+  if (f->outermost)
+    __atomic_fetch_add(&f->record->inclusive,
+                       subtract(elapsed, f->probes * probe_outside),
+                       __ATOMIC_RELAXED);
+
+  if (depth > 0){
+    frames[depth-1].children += elapsed + probe_outside;
+    frames[depth-1].probes += f->probes + 1;
+  }
+}
+
+void cycles_exit(FunctionCycles *record, unsigned long long now){
+  /*
+    Frames left open by longjmp or by exceptions that crossed functions
+    without probes are closed now. An exit without a matching frame (after
+    dump_cycles closed it, for instance) is ignored.
+  */
+  if (depth > MAX_DEPTH){
+    --depth;
+    return;
+  }
+
+  /* The usual case, without a search */
+  if (depth > 0 && frames[depth-1].record == record){
+    pop_frame(now);
+    return;
+  }
+
+  int i;
+  for (i=depth-1; i>=0 && frames[i].record != record; i--);
+  if (i < 0)
+    return;
+
+  while (depth > i)
+    pop_frame(now);
+}
+
+typedef struct CycleEntry{
+  Site *site;
+  FunctionCycles *cycles;
+} CycleEntry;
+
+static int compare_cycles(const void *a, const void *b){
+  unsigned long long ea = ((const CycleEntry*)a)->cycles->exclusive;
+  unsigned long long eb = ((const CycleEntry*)b)->cycles->exclusive;
+  return (ea < eb) - (ea > eb);
+}
+
+void dump_cycles(){
+  if (num_cycle_tables == 0)
+    return;
+
+  /* The functions of this thread that are still running, main included */
+  unsigned long long now = read_cycles();
+  while (depth > 0)
+    pop_frame(now);
+
+  int n = 0;
+  for (int t=0; t<num_cycle_tables; t++)
+    n += cycle_tables[t].n;
+
+  CycleEntry *entries = malloc(n * sizeof(CycleEntry));
+  n = 0;
+  for (int t=0; t<num_cycle_tables; t++){
+    for (int i=0; i<cycle_tables[t].n; i++){
+      if (cycle_tables[t].cycles[i].calls == 0)
+        continue;
+      entries[n].site = &cycle_tables[t].sites[i];
+      entries[n].cycles = &cycle_tables[t].cycles[i];
+      ++n;
+    }
+  }
+
+  qsort(entries, n, sizeof(CycleEntry), compare_cycles);
+
+  FILE *f;
+  f = fopen(CYCLES_FILENAME, "w");
+  if (f != NULL){
+
+    fprintf(f, "FUNCTION,FILE,LINE,CALLS,INCLUSIVE,EXCLUSIVE\n");
+    for (int i=0; i<n; i++){
+      Site *s = entries[i].site;
+      FunctionCycles *c = entries[i].cycles;
+      fprintf(f, "%s,%s,%d,%llu,%llu,%llu\n", s->function, s->file, s->line,
+              c->calls, c->inclusive, c->exclusive);
+    }
+
+    fclose(f);
+  }
+  else {
+    printf("Cannot create file\n");
+  }
+
+  free(entries);
+}
+
+void register_costs(CostSite *sites, unsigned long long *counters, int n){
+  if (num_cost_tables == MAX_MODULES){
+    printf("Too many modules, ignoring cost counters\n");
+    return;
+  }
+
+  cost_tables[num_cost_tables].sites = sites;
+  cost_tables[num_cost_tables].counters = counters;
+  cost_tables[num_cost_tables].n = n;
+  ++num_cost_tables;
+}
+
+void register_ilp(Site *sites, FunctionILP *records, int n){
+  if (num_ilp_tables == MAX_MODULES){
+    printf("Too many modules, ignoring ILP\n");
+    return;
+  }
+
+  ilp_tables[num_ilp_tables].sites = sites;
+  ilp_tables[num_ilp_tables].records = records;
+  ilp_tables[num_ilp_tables].n = n;
+  ++num_ilp_tables;
+}
+
+/*
+  Ready time of a word, stored by the invocation `id`. The words are not
+  synchronized: with several threads a load may see the time of a word
+  stored by another invocation as 0.
+*/
+typedef struct ShadowWord{
+  unsigned long long id;
+  unsigned long long time;
+} ShadowWord;
+
+static void *ilp_shadow[1 << ILP_TOP_BITS];
+static unsigned long long ilp_invocations = 0;
+
+/*
+  The table at `*slot`, allocated if `create` is set and it does not exist
+  yet. Threads that allocate it at the same time keep the first one.
+*/
+static void* shadow_table(void **slot, size_t size, int create){
+  void *table = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (table != NULL || !create)
+    return table;
+
+  table = calloc(1, size);
+  if (table == NULL)
+    return NULL;
+
+  void *expected = NULL;
+  if (!__atomic_compare_exchange_n(slot, &expected, table, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+    free(table);
+    return expected;
+  }
+  return table;
+}
+
+/* NULL when the word has never been stored, unless `create` is set */
+static ShadowWord* shadow_word(void *addr, int create){
+  unsigned long long word = ((unsigned long long)addr & ((1ULL << 48) - 1)) >> 3;
+  unsigned long long top = word >> (ILP_MID_BITS + ILP_LEAF_BITS);
+  unsigned long long mid = (word >> ILP_LEAF_BITS) & ((1 << ILP_MID_BITS) - 1);
+
+  void **mids = shadow_table(&ilp_shadow[top],
+                             sizeof(void*) << ILP_MID_BITS, create);
+  if (mids == NULL)
+    return NULL;
+
+  ShadowWord *leaf = shadow_table(&mids[mid],
+                                  sizeof(ShadowWord) << ILP_LEAF_BITS, create);
+  if (leaf == NULL)
+    return NULL;
+  return &leaf[word & ((1 << ILP_LEAF_BITS) - 1)];
+}
+
+unsigned long long ilp_enter(){
+  return __atomic_add_fetch(&ilp_invocations, 1, __ATOMIC_RELAXED);
+}
+
+void ilp_exit(FunctionILP *record, unsigned long long instructions,
+              unsigned long long critical){
+  __atomic_fetch_add(&record->invocations, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&record->instructions, instructions, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&record->critical, critical, __ATOMIC_RELAXED);
+}
+
+unsigned long long ilp_load(void *addr, unsigned long long id){
+  ShadowWord *w = shadow_word(addr, 0);
+  if (w != NULL && w->id == id)
+    return w->time;
+  return 0;
+}
+
+void ilp_store(void *addr, unsigned long long id, unsigned long long time){
+  ShadowWord *w = shadow_word(addr, 1);
+  if (w == NULL)
+    return;
+  w->id = id;
+  w->time = time;
+}
+
+typedef struct ILPEntry{
+  Site *site;
+  FunctionILP *record;
+} ILPEntry;
+
+static int compare_ilp(const void *a, const void *b){
+  unsigned long long ia = ((const ILPEntry*)a)->record->instructions;
+  unsigned long long ib = ((const ILPEntry*)b)->record->instructions;
+  return (ia < ib) - (ia > ib);
+}
+
+void dump_ilp(){
+  if (num_ilp_tables == 0)
+    return;
+
+  int n = 0;
+  for (int t=0; t<num_ilp_tables; t++)
+    n += ilp_tables[t].n;
+
+  ILPEntry *entries = malloc(n * sizeof(ILPEntry));
+  n = 0;
+  for (int t=0; t<num_ilp_tables; t++){
+    for (int i=0; i<ilp_tables[t].n; i++){
+      if (ilp_tables[t].records[i].invocations == 0)
+        continue;
+      entries[n].site = &ilp_tables[t].sites[i];
+      entries[n].record = &ilp_tables[t].records[i];
+      ++n;
+    }
+  }
+
+  /* The functions that execute the most instructions first */
+  qsort(entries, n, sizeof(ILPEntry), compare_ilp);
+
+  FILE *f;
+  f = fopen(ILP_FILENAME, "w");
+  if (f != NULL){
+
+    fprintf(f, "FUNCTION,FILE,LINE,INVOCATIONS,INSTRUCTIONS,CRITICAL_PATH,ILP\n");
+    for (int i=0; i<n; i++){
+      Site *s = entries[i].site;
+      FunctionILP *r = entries[i].record;
+      fprintf(f, "%s,%s,%d,%llu,%llu,%llu,%.2f\n", s->function, s->file,
+              s->line, r->invocations, r->instructions, r->critical,
+              r->critical ? (double)r->instructions / r->critical : 0.0);
+    }
+
+    fclose(f);
+  }
+  else {
+    printf("Cannot create file\n");
+  }
+
+  free(entries);
+}
+
+typedef struct CostEntry{
+  CostSite *site;
+  unsigned long long *counters;
+} CostEntry;
+
+static int compare_costs(const void *a, const void *b){
+  unsigned long long ta = ((const CostEntry*)a)->counters[1];
+  unsigned long long tb = ((const CostEntry*)b)->counters[1];
+  return (ta < tb) - (ta > tb);
+}
+
+void dump_costs(){
+  if (num_cost_tables == 0)
+    return;
+
+  int n = 0;
+  for (int t=0; t<num_cost_tables; t++)
+    n += cost_tables[t].n;
+
+  CostEntry *entries = malloc(n * sizeof(CostEntry));
+  n = 0;
+  for (int t=0; t<num_cost_tables; t++){
+    for (int i=0; i<cost_tables[t].n; i++){
+      unsigned long long *counters = &cost_tables[t].counters[3*i];
+      if (counters[0] == 0)
+        continue;
+      entries[n].site = &cost_tables[t].sites[i];
+      entries[n].counters = counters;
+      ++n;
+    }
+  }
+
+  /* The most expensive pairs first */
+  qsort(entries, n, sizeof(CostEntry), compare_costs);
+
+  FILE *f;
+  f = fopen(COST_FILENAME, "w");
+  if (f != NULL){
+
+    fprintf(f, "FUNCTION,OPCODE,COUNT,THROUGHPUT,LATENCY\n");
+    for (int i=0; i<n; i++){
+      CostSite *s = entries[i].site;
+      unsigned long long *c = entries[i].counters;
+      fprintf(f, "%s,%s,%llu,%llu,%llu\n", s->function, s->opcode, c[0],
+              c[1], c[2]);
+    }
+
+    fclose(f);
+  }
+  else {
+    printf("Cannot create file\n");
+  }
+
+  free(entries);
+}
+
+void register_memory(const char **functions, unsigned long long *counters, int n){
+  if (num_memory_tables == MAX_MODULES){
+    printf("Too many modules, ignoring memory counters\n");
+    return;
+  }
+
+  memory_tables[num_memory_tables].functions = functions;
+  memory_tables[num_memory_tables].counters = counters;
+  memory_tables[num_memory_tables].n = n;
+  ++num_memory_tables;
+}
+
+void register_allocs(Site *sites, AllocProfile *profiles, int n){
+  if (num_alloc_tables == MAX_MODULES){
+    printf("Too many modules, ignoring allocations\n");
+    return;
+  }
+
+  alloc_tables[num_alloc_tables].sites = sites;
+  alloc_tables[num_alloc_tables].profiles = profiles;
+  alloc_tables[num_alloc_tables].n = n;
+  ++num_alloc_tables;
+}
+
+void profile_alloc(AllocProfile *p, unsigned long long size){
+  int bucket = size ? 64 - __builtin_clzll(size) : 0;
+  if (bucket >= ALLOC_BUCKETS)
+    bucket = ALLOC_BUCKETS - 1;
+
+  __atomic_fetch_add(&p->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&p->bytes, size, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&p->buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+void profile_free(AllocProfile *p, void *ptr){
+#ifdef __APPLE__
+  profile_alloc(p, ptr ? malloc_size(ptr) : 0);
+#else
+  profile_alloc(p, ptr ? malloc_usable_size(ptr) : 0);
+#endif
+}
+
+void dump_memory(){
+  FILE *f;
+
+  if (num_memory_tables > 0){
+    f = fopen(MEMORY_FILENAME, "w");
+    if (f != NULL){
+      fprintf(f, "FUNCTION,LOADS,LOAD_BYTES,STORES,STORE_BYTES\n");
+      for (int t=0; t<num_memory_tables; t++){
+        MemoryTable *table = &memory_tables[t];
+        for (int i=0; i<table->n; i++){
+          unsigned long long *c = &table->counters[4*i];
+          if (c[0] + c[1] + c[2] + c[3] == 0)
+            continue;
+          fprintf(f, "%s,%llu,%llu,%llu,%llu\n", table->functions[i], c[0],
+                  c[1], c[2], c[3]);
+        }
+      }
+      fclose(f);
+    }
+    else {
+      printf("Cannot create file\n");
+    }
+  }
+
+  if (num_alloc_tables > 0){
+    f = fopen(ALLOCS_FILENAME, "w");
+    if (f != NULL){
+      /* HISTOGRAM lists <bound>:<count> for the non-empty buckets, the sizes
+         below bound and at least half of it */
+      fprintf(f, "FUNCTION,FILE,LINE,KIND,COUNT,BYTES,HISTOGRAM\n");
+      for (int t=0; t<num_alloc_tables; t++){
+        AllocTable *table = &alloc_tables[t];
+        for (int i=0; i<table->n; i++){
+          Site *s = &table->sites[i];
+          AllocProfile *p = &table->profiles[i];
+          if (p->count == 0)
+            continue;
+
+          fprintf(f, "%s,%s,%d,%s,%llu,%llu,", s->function, s->file, s->line,
+                  s->kind, p->count, p->bytes);
+          const char *sep = "";
+          for (int b=0; b<ALLOC_BUCKETS; b++){
+            if (p->buckets[b] == 0)
+              continue;
+            fprintf(f, "%s%llu:%llu", sep, b ? 1ULL << b : 0ULL,
+                    p->buckets[b]);
+            sep = " ";
+          }
+          fprintf(f, "\n");
+        }
+      }
+      fclose(f);
+    }
+    else {
+      printf("Cannot create file\n");
+    }
+  }
+}
+
+void register_sanitizers(SanitizerSite *sites, unsigned long long *counters,
+                         int n){
+  if (num_sanitizer_tables == MAX_MODULES){
+    printf("Too many modules, ignoring sanitizers\n");
+    return;
+  }
+
+  sanitizer_tables[num_sanitizer_tables].sites = sites;
+  sanitizer_tables[num_sanitizer_tables].counters = counters;
+  sanitizer_tables[num_sanitizer_tables].n = n;
+  ++num_sanitizer_tables;
+}
+
+static int find_name(const char **names, int *n, const char *name){
+  for (int i=0; i<*n; i++)
+    if (strcmp(names[i], name) == 0)
+      return i;
+  names[*n] = name;
+  return (*n)++;
+}
+
+/*
+  One row per opcode and a TOTAL row, with the count as user code, the
+  count in sanitizer code and a column per kind of check
+*/
+void dump_sanitizers(){
+  if (num_sanitizer_tables == 0)
+    return;
+
+  int n = 0;
+  for (int t=0; t<num_sanitizer_tables; t++)
+    n += sanitizer_tables[t].n;
+
+  /* Kind 0 is the user code */
+  const char **kinds = malloc((n + 1) * sizeof(char*));
+  const char **opcodes = malloc(n * sizeof(char*));
+  unsigned long long *counts = calloc((size_t)(n + 1) * n,
+                                      sizeof(unsigned long long));
+  int num_kinds = 1, num_opcodes = 0;
+  kinds[0] = "user";
+
+  for (int t=0; t<num_sanitizer_tables; t++){
+    SanitizerTable *table = &sanitizer_tables[t];
+    for (int i=0; i<table->n; i++){
+      int k = find_name(kinds, &num_kinds, table->sites[i].kind);
+      int o = find_name(opcodes, &num_opcodes, table->sites[i].opcode);
+      counts[o * (n + 1) + k] += table->counters[i];
+    }
+  }
+
+  FILE *f = fopen(SANITIZERS_FILENAME, "w");
+  if (f != NULL){
+    fprintf(f, "OPCODE,USER,SANITIZER");
+    for (int k=1; k<num_kinds; k++)
+      fprintf(f, ",%s", kinds[k]);
+    fprintf(f, "\n");
+
+    unsigned long long *total = calloc(num_kinds, sizeof(unsigned long long));
+    for (int o=0; o<=num_opcodes; o++){
+      unsigned long long *row = o < num_opcodes ? &counts[o * (n + 1)] : total;
+      unsigned long long sanitizer = 0;
+      for (int k=1; k<num_kinds; k++)
+        sanitizer += row[k];
+
+      fprintf(f, "%s,%llu,%llu", o < num_opcodes ? opcodes[o] : "TOTAL",
+              row[0], sanitizer);
+      for (int k=1; k<num_kinds; k++)
+        fprintf(f, ",%llu", row[k]);
+      fprintf(f, "\n");
+
+      if (o < num_opcodes)
+        for (int k=0; k<num_kinds; k++)
+          total[k] += row[k];
+    }
+
+    free(total);
+    fclose(f);
+  }
+  else {
+    printf("Cannot create file\n");
+  }
+
+  free(kinds);
+  free(opcodes);
+  free(counts);
+}
+
+void register_loops(Site *sites, LoopProfile *profiles, int n){
+  if (num_loop_tables == MAX_MODULES){
+    printf("Too many modules, ignoring loops\n");
+    return;
+  }
+
+  loop_tables[num_loop_tables].sites = sites;
+  loop_tables[num_loop_tables].profiles = profiles;
+  loop_tables[num_loop_tables].n = n;
+  ++num_loop_tables;
+}
+
+void profile_trips(LoopProfile *p, unsigned long long trips){
+  int bucket = trips ? 64 - __builtin_clzll(trips) : 0;
+  if (bucket >= TRIP_BUCKETS)
+    bucket = TRIP_BUCKETS - 1;
+
+  __atomic_fetch_add(&p->entries, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&p->trips, trips, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&p->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+  unsigned long long max = __atomic_load_n(&p->max, __ATOMIC_RELAXED);
+  while (trips > max &&
+         !__atomic_compare_exchange_n(&p->max, &max, trips, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+void dump_loops(){
+  if (num_loop_tables == 0)
+    return;
+
+  FILE *f = fopen(LOOPS_FILENAME, "w");
+  if (f == NULL){
+    printf("Cannot create file\n");
+    return;
+  }
+
+  /* HISTOGRAM lists <bound>:<count> for the non-empty buckets, the trip
+     counts below bound and at least half of it */
+  fprintf(f, "FUNCTION,FILE,LINE,DEPTH,ENTRIES,TRIPS,AVERAGE,MAX,HISTOGRAM\n");
+  for (int t=0; t<num_loop_tables; t++){
+    LoopTable *table = &loop_tables[t];
+    for (int i=0; i<table->n; i++){
+      Site *s = &table->sites[i];
+      LoopProfile *p = &table->profiles[i];
+      if (p->entries == 0)
+        continue;
+
+      /* The kind of a loop site is depth=<n> */
+      const char *depth = strchr(s->kind, '=');
+      fprintf(f, "%s,%s,%d,%s,%llu,%llu,%.2f,%llu,", s->function, s->file,
+              s->line, depth ? depth + 1 : s->kind, p->entries, p->trips,
+              (double)p->trips / p->entries, p->max);
+      const char *sep = "";
+      for (int b=0; b<TRIP_BUCKETS; b++){
+        if (p->buckets[b] == 0)
+          continue;
+        fprintf(f, "%s%llu:%llu", sep, b ? 1ULL << b : 0ULL, p->buckets[b]);
+        sep = " ";
+      }
+      fprintf(f, "\n");
+    }
+  }
+  fclose(f);
+}
+
+void register_paths(PathSite *sites, unsigned long long *counters, int n){
+  if (num_path_tables == MAX_MODULES){
+    printf("Too many modules, ignoring paths\n");
+    return;
+  }
+
+  path_tables[num_path_tables].sites = sites;
+  path_tables[num_path_tables].counters = counters;
+  path_tables[num_path_tables].n = n;
+  ++num_path_tables;
+}
+
+/*
+  Open addressing with linear probing. A free entry is claimed with a
+  compare-and-swap of its key, so threads never lose a path.
+*/
+void profile_path(unsigned long long *table, unsigned long long path){
+  unsigned long long key = path + 1;
+  unsigned long long h = (key * 0x9e3779b97f4a7c15ULL) >> 32;
+
+  for (int probe=0; probe<PATH_HASH_SIZE; probe++){
+    unsigned long long *entry = &table[1 + 2*((h + probe) & (PATH_HASH_SIZE - 1))];
+    unsigned long long current = __atomic_load_n(entry, __ATOMIC_RELAXED);
+    if (current == 0 &&
+        __atomic_compare_exchange_n(entry, &current, key, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      current = key;
+
+    if (current == key){
+      __atomic_fetch_add(&entry[1], 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  __atomic_fetch_add(&table[0], 1, __ATOMIC_RELAXED);
+}
+
+void dump_paths(){
+  if (num_path_tables == 0)
+    return;
+
+  FILE *f = fopen(PATHS_FILENAME, "w");
+  if (f != NULL){
+    fprintf(f, "FUNCTION,FILE,PATH,COUNT\n");
+    for (int t=0; t<num_path_tables; t++){
+      PathTable *table = &path_tables[t];
+      for (int i=0; i<table->n; i++){
+        PathSite *s = &table->sites[i];
+        unsigned long long *c = &table->counters[s->offset];
+
+        if (strcmp(s->site.kind, "hash")){
+          for (unsigned long long p=0; p<s->paths; p++)
+            if (c[p])
+              fprintf(f, "%s,%s,%llu,%llu\n", s->site.function, s->site.file,
+                      p, c[p]);
+          continue;
+        }
+
+        for (int e=0; e<PATH_HASH_SIZE; e++)
+          if (c[1 + 2*e])
+            fprintf(f, "%s,%s,%llu,%llu\n", s->site.function, s->site.file,
+                    c[1 + 2*e] - 1, c[2 + 2*e]);
+        if (c[0])
+          printf("%s: %llu paths did not fit in the hash table\n",
+                 s->site.function, c[0]);
+      }
+    }
+    fclose(f);
+  }
+  else {
+    printf("Cannot create file\n");
+  }
+
+  f = fopen(PATHS_GRAPH_FILENAME, "w");
+  if (f != NULL){
+    for (int t=0; t<num_path_tables; t++){
+      PathTable *table = &path_tables[t];
+      for (int i=0; i<table->n; i++){
+        PathSite *s = &table->sites[i];
+        /* Without debug info the file is empty, "-" keeps the fields */
+        fprintf(f, "function %s %s %llu\n%s", s->site.function,
+                s->site.file[0] ? s->site.file : "-", s->paths, s->graph);
+      }
+    }
+    fclose(f);
+  }
+  else {
+    printf("Cannot create file\n");
+  }
+}
+
+void register_coverage(CoverageSite *sites, unsigned char *bitmap, int n){
+  if (num_coverage_tables == MAX_MODULES){
+    printf("Too many modules, ignoring coverage\n");
+    return;
+  }
+
+  coverage_tables[num_coverage_tables].sites = sites;
+  coverage_tables[num_coverage_tables].bitmap = bitmap;
+  coverage_tables[num_coverage_tables].n = n;
+  ++num_coverage_tables;
+}
+
+static unsigned long long hash_string(unsigned long long h, const char *s){
+  for (; *s; s++)
+    h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+  return (h ^ 0xff) * 1099511628211ULL;
+}
+
+/*
+  Identifies the layout of a table, so that Tools/covmerge only merges
+  runs of the same program
+*/
+static unsigned long long hash_coverage(CoverageTable *table){
+  unsigned long long h = 14695981039346656037ULL;
+  for (int i=0; i<table->n; i++){
+    h = hash_string(h, table->sites[i].site.function);
+    h = hash_string(h, table->sites[i].site.file);
+    h = (h ^ (unsigned)table->sites[i].site.line) * 1099511628211ULL;
+  }
+  return h;
+}
+
+/*
+  coverage.bin is "COV1" <tables: u32>, then for each table
+  <blocks: u32> <layout hash: u64> and a bit per block, in bytes of 8
+  blocks. coverage.csv has the covered blocks of each function.
+*/
+void dump_coverage(){
+  if (num_coverage_tables == 0)
+    return;
+
+  FILE *f;
+  f = fopen(COVERAGE_FILENAME, "wb");
+  if (f != NULL){
+    unsigned int tables = num_coverage_tables;
+    fwrite("COV1", 1, 4, f);
+    fwrite(&tables, sizeof(tables), 1, f);
+
+    for (int t=0; t<num_coverage_tables; t++){
+      CoverageTable *table = &coverage_tables[t];
+      unsigned int n = table->n;
+      unsigned long long hash = hash_coverage(table);
+      fwrite(&n, sizeof(n), 1, f);
+      fwrite(&hash, sizeof(hash), 1, f);
+
+      unsigned char byte = 0;
+      for (int i=0; i<table->n; i++){
+        if (table->bitmap[table->sites[i].leader])
+          byte |= 1 << (i % 8);
+        if (i % 8 == 7 || i == table->n - 1){
+          fputc(byte, f);
+          byte = 0;
+        }
+      }
+    }
+
+    fclose(f);
+  }
+  else {
+    printf("Cannot create file\n");
+  }
+
+  f = fopen(COVERAGE_SUMMARY_FILENAME, "w");
+  if (f != NULL){
+    fprintf(f, "FUNCTION,FILE,BLOCKS,COVERED\n");
+    for (int t=0; t<num_coverage_tables; t++){
+      CoverageTable *table = &coverage_tables[t];
+
+      /* The blocks of a function are consecutive */
+      int blocks = 0, covered = 0;
+      for (int i=0; i<table->n; i++){
+        ++blocks;
+        covered += table->bitmap[table->sites[i].leader] != 0;
+        if (i == table->n - 1 ||
+            table->sites[i+1].site.function != table->sites[i].site.function){
+          fprintf(f, "%s,%s,%d,%d\n", table->sites[i].site.function,
+                  table->sites[i].site.file, blocks, covered);
+          blocks = covered = 0;
+        }
+      }
+    }
+    fclose(f);
+  }
+  else {
+    printf("Cannot create file\n");
+  }
+}
+
 void dump_csv(){
 
+  dump_lines();
+  dump_values();
+  dump_branches();
+  dump_calls();
+  dump_strides();
+  dump_cycles();
+  dump_costs();
+  dump_memory();
+  dump_ilp();
+  dump_sanitizers();
+  dump_loops();
+  dump_paths();
+  dump_coverage();
+
   FILE *f;
   f = fopen(FILENAME, "w");
   if (f != NULL){
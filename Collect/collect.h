@@ -1,6 +1,71 @@
 #pragma once
 
 #define FILENAME "count.csv"
+#define LINES_FILENAME "lines.csv"
+#define VALUES_FILENAME "values.csv"
+#define BRANCHES_FILENAME "branches.csv"
+#define CALLS_FILENAME "calls.csv"
+#define STRIDES_FILENAME "strides.csv"
+#define CYCLES_FILENAME "cycles.csv"
+#define COST_FILENAME "cost.csv"
+#define MEMORY_FILENAME "memory.csv"
+#define ALLOCS_FILENAME "allocs.csv"
+#define LOOPS_FILENAME "loops.csv"
+#define PATHS_FILENAME "paths.csv"
+#define PATHS_GRAPH_FILENAME "paths.graph"
+#define SANITIZERS_FILENAME "sanitizers.csv"
+#define ILP_FILENAME "ilp.csv"
+#define COVERAGE_FILENAME "coverage.bin"
+#define COVERAGE_SUMMARY_FILENAME "coverage.csv"
+
+#define MAX_MODULES 1024
+
+/*
+  Depth of the per-thread shadow stack of -instrument-cycles, the calls
+  deeper than this are not measured
+*/
+#define MAX_DEPTH 4096
+#define CALIBRATION_ROUNDS 10000
+
+// Functions per thread whose activations are counted, a power of 2
+#define ACTIVE_SLOTS 4096
+
+/*
+  Shadow memory of -instrument-ilp: a table of three levels over the
+  words of 8 bytes of the 48-bit address space, with the bits of the word
+  number that index each level. The lower levels are allocated on the
+  first store to their range, so every word keeps its own ready time.
+*/
+#define ILP_TOP_BITS 13
+#define ILP_MID_BITS 14
+#define ILP_LEAF_BITS 18
+
+/*
+  Values kept per value-profiling site, must match VALUE_TOPK in
+  Instrument/Instrument.h. A site is reported as dominated by a single
+  value when it accounts for DOMINANT_RATIO of the executions.
+*/
+#define VALUE_TOPK 4
+#define DOMINANT_RATIO 0.9
+
+/*
+  log2 buckets of the allocation sizes, must match ALLOC_BUCKETS in
+  Instrument/Instrument.h. Bucket b counts the sizes in [2^(b-1), 2^b).
+*/
+#define ALLOC_BUCKETS 64
+
+/*
+  log2 buckets of the loop trip counts, must match TRIP_BUCKETS in
+  Instrument/Instrument.h, with the same bounds as ALLOC_BUCKETS
+*/
+#define TRIP_BUCKETS 64
+
+/*
+  Entries of the hash table of the functions with too many paths for an
+  array, must match PATH_HASH_SIZE in Instrument/Instrument.h. A power
+  of two.
+*/
+#define PATH_HASH_SIZE 1024
 
 typedef struct Instruction{
   char name[10];
@@ -10,9 +75,367 @@ typedef struct Instruction{
 static Instruction array[10000];
 static int size = 0;
 
+/*
+  Layout of the `line_sites` table emitted by the Instrument pass
+  when it runs with -instrument-lines
+*/
+typedef struct LineSite{
+  const char *file;
+  int line;
+  const char *opcode;
+} LineSite;
+
+typedef struct LineTable{
+  LineSite *sites;
+  unsigned long long *counters;
+  int n;
+} LineTable;
+
+static LineTable line_tables[MAX_MODULES];
+static int num_line_tables = 0;
+
+/*
+  Generic description of an instrumented instruction, emitted by
+  Instrument::alloc_site
+*/
+typedef struct Site{
+  const char *function;
+  const char *file;
+  int line;
+  const char *kind;
+} Site;
+
+/*
+  The VALUE_TOPK most frequent values of a site, kept with an approximate
+  space-saving: a value not in the table replaces the one with the
+  smallest count and takes over its count, recorded in `errors`, so a
+  value that dominates stays in the table however late it first appears.
+  counts - errors are the executions known to have that value, and the
+  rest of `total` is reported as other. The table is lock-free: a slot is
+  claimed or evicted with a CAS on `state` (0 free, 1 being written, 2 in
+  use), and an execution that finds its slot taken by another thread goes
+  to other. Two threads may claim two slots for the same value; the
+  report merges them.
+*/
+typedef struct ValueProfile{
+  unsigned long long values[VALUE_TOPK];
+  unsigned long long counts[VALUE_TOPK];
+  unsigned long long errors[VALUE_TOPK];
+  unsigned long long total;
+  unsigned char state[VALUE_TOPK];
+} ValueProfile;
+
+typedef struct ValueTable{
+  Site *sites;
+  ValueProfile *profiles;
+  int n;
+} ValueTable;
+
+static ValueTable value_tables[MAX_MODULES];
+static int num_value_tables = 0;
+
+/*
+  A Site followed by the line of the destination of the edge and the line
+  where the function starts, which Tools/export_profile needs to write
+  line offsets.
+*/
+typedef struct BranchSite{
+  Site site;
+  int target_line;
+  int function_line;
+} BranchSite;
+
+typedef struct BranchTable{
+  BranchSite *sites;
+  unsigned long long *counters;
+  int n;
+} BranchTable;
+
+static BranchTable branch_tables[MAX_MODULES];
+static int num_branch_tables = 0;
+
+/*
+  Direct call sites, described by Instrument::alloc_site with the callee
+  as the kind, and the indirect ones, whose targets are value profiles.
+*/
+typedef struct CallTable{
+  Site *sites;
+  unsigned long long *counters;
+  int n;
+} CallTable;
+
+static CallTable call_tables[MAX_MODULES];
+static int num_call_tables = 0;
+
+static ValueTable indirect_tables[MAX_MODULES];
+static int num_indirect_tables = 0;
+
+/*
+  A load or store inside a loop. When `is_static` is set, SCEV proved that
+  the address advances by `stride` bytes per iteration and the site has no
+  profile.
+*/
+typedef struct StrideSite{
+  Site site;
+  int size;
+  int is_static;
+  long long stride;
+} StrideSite;
+
+/*
+  Distance between consecutive addresses of a site: `unit` when it is the
+  size of the access, `constant` when it repeats the previous distance
+  (kept in `stride` once `have_stride` is set), `irregular` otherwise. The
+  first distance that is not unit only sets `stride`. The counts are
+  atomic, but the accesses of several threads to a site interleave, so a
+  shared site gets an approximate classification.
+*/
+typedef struct StrideProfile{
+  unsigned long long last;
+  long long stride;
+  unsigned long long have_stride;
+  unsigned long long unit;
+  unsigned long long constant;
+  unsigned long long irregular;
+} StrideProfile;
+
+typedef struct StrideTable{
+  StrideSite *sites;
+  StrideProfile *profiles;
+  int n;
+} StrideTable;
+
+static StrideTable stride_tables[MAX_MODULES];
+static int num_stride_tables = 0;
+
+/*
+  Cycles of an instrumented function, over all threads, with the probe
+  overhead already subtracted
+*/
+typedef struct FunctionCycles{
+  unsigned long long calls;
+  unsigned long long inclusive;
+  unsigned long long exclusive;
+} FunctionCycles;
+
+typedef struct CycleTable{
+  Site *sites;
+  FunctionCycles *cycles;
+  int n;
+} CycleTable;
+
+static CycleTable cycle_tables[MAX_MODULES];
+static int num_cycle_tables = 0;
+
+/*
+  Invocations of a function of -instrument-ilp, the instructions they
+  executed and the sum of their critical paths, in latency units. Only
+  finished invocations count: main and a function that calls exit finish
+  before dump_csv, the callers of that function are dropped.
+*/
+typedef struct FunctionILP{
+  unsigned long long invocations;
+  unsigned long long instructions;
+  unsigned long long critical;
+} FunctionILP;
+
+typedef struct ILPTable{
+  Site *sites;
+  FunctionILP *records;
+  int n;
+} ILPTable;
+
+static ILPTable ilp_tables[MAX_MODULES];
+static int num_ilp_tables = 0;
+
+/*
+  A (function, opcode) pair of -instrument-cost. Its three counters are
+  the executions and the sums of the throughput and latency costs.
+*/
+typedef struct CostSite{
+  const char *function;
+  const char *opcode;
+} CostSite;
+
+typedef struct CostTable{
+  CostSite *sites;
+  unsigned long long *counters;
+  int n;
+} CostTable;
+
+static CostTable cost_tables[MAX_MODULES];
+static int num_cost_tables = 0;
+
+/*
+  A (kind, opcode) pair of -instrument-sanitizers. The kind is "user",
+  "nosanitize" or the sanitizer runtime function of the check, such as
+  asan_report_load8.
+*/
+typedef struct SanitizerSite{
+  const char *kind;
+  const char *opcode;
+} SanitizerSite;
+
+typedef struct SanitizerTable{
+  SanitizerSite *sites;
+  unsigned long long *counters;
+  int n;
+} SanitizerTable;
+
+static SanitizerTable sanitizer_tables[MAX_MODULES];
+static int num_sanitizer_tables = 0;
+
+/*
+  Per-function counters of -instrument-memory: loads, bytes loaded,
+  stores and bytes stored. The table has the names of the functions.
+*/
+typedef struct MemoryTable{
+  const char **functions;
+  unsigned long long *counters;
+  int n;
+} MemoryTable;
+
+static MemoryTable memory_tables[MAX_MODULES];
+static int num_memory_tables = 0;
+
+/*
+  Allocations of a site (alloca, malloc, calloc, realloc, new) or the
+  releases (free, delete), whose size is the usable size of the block
+*/
+typedef struct AllocProfile{
+  unsigned long long count;
+  unsigned long long bytes;
+  unsigned long long buckets[ALLOC_BUCKETS];
+} AllocProfile;
+
+typedef struct AllocTable{
+  Site *sites;
+  AllocProfile *profiles;
+  int n;
+} AllocTable;
+
+static AllocTable alloc_tables[MAX_MODULES];
+static int num_alloc_tables = 0;
+
+/*
+  Trip counts of a loop of -instrument-loops: the number of times it was
+  entered, the iterations of its header over all of them, the largest
+  trip count and its histogram
+*/
+typedef struct LoopProfile{
+  unsigned long long entries;
+  unsigned long long trips;
+  unsigned long long max;
+  unsigned long long buckets[TRIP_BUCKETS];
+} LoopProfile;
+
+typedef struct LoopTable{
+  Site *sites;
+  LoopProfile *profiles;
+  int n;
+} LoopTable;
+
+static LoopTable loop_tables[MAX_MODULES];
+static int num_loop_tables = 0;
+
+/*
+  A function of -instrument-paths. Its counters start at `offset`: an
+  array with one counter per path, or, when the kind of the site is
+  "hash", the number of paths that did not fit followed by PATH_HASH_SIZE
+  (path + 1, count) pairs. `graph` is the numbered DAG of the function,
+  for Tools/decode_paths.
+*/
+typedef struct PathSite{
+  Site site;
+  unsigned long long paths;
+  unsigned long long offset;
+  const char *graph;
+} PathSite;
+
+typedef struct PathTable{
+  PathSite *sites;
+  unsigned long long *counters;
+  int n;
+} PathTable;
+
+static PathTable path_tables[MAX_MODULES];
+static int num_path_tables = 0;
+
+/*
+  A block of -instrument-coverage and the byte of the bitmap set by the
+  leader of its class of control-equivalent blocks
+*/
+typedef struct CoverageSite{
+  Site site;
+  int leader;
+} CoverageSite;
+
+typedef struct CoverageTable{
+  CoverageSite *sites;
+  unsigned char *bitmap;
+  int n;
+} CoverageTable;
+
+static CoverageTable coverage_tables[MAX_MODULES];
+static int num_coverage_tables = 0;
+
 void count_instruction(char*);
 void dump_csv();
 
+void register_lines(LineSite*, unsigned long long*, int);
+void basilisk_increment(unsigned long long*, unsigned long long);
+
+void register_values(Site*, ValueProfile*, int);
+void profile_value(ValueProfile*, unsigned long long);
+void dump_values();
+
+void register_branches(BranchSite*, unsigned long long*, int);
+void dump_branches();
+void dump_lines();
+
+void register_calls(Site*, unsigned long long*, int);
+void register_indirect_calls(Site*, ValueProfile*, int);
+void dump_calls();
+
+void register_strides(StrideSite*, StrideProfile*, int);
+void profile_stride(StrideProfile*, void*, long long);
+void dump_strides();
+
+void register_cycles(Site*, FunctionCycles*, int);
+void cycles_enter(FunctionCycles*, unsigned long long);
+void cycles_exit(FunctionCycles*, unsigned long long);
+void dump_cycles();
+
+void register_ilp(Site*, FunctionILP*, int);
+unsigned long long ilp_enter();
+void ilp_exit(FunctionILP*, unsigned long long, unsigned long long);
+unsigned long long ilp_load(void*, unsigned long long);
+void ilp_store(void*, unsigned long long, unsigned long long);
+void dump_ilp();
+
+void register_costs(CostSite*, unsigned long long*, int);
+void dump_costs();
+
+void register_sanitizers(SanitizerSite*, unsigned long long*, int);
+void dump_sanitizers();
+
+void register_memory(const char**, unsigned long long*, int);
+void register_allocs(Site*, AllocProfile*, int);
+void profile_alloc(AllocProfile*, unsigned long long);
+void profile_free(AllocProfile*, void*);
+void dump_memory();
+
+void register_loops(Site*, LoopProfile*, int);
+void profile_trips(LoopProfile*, unsigned long long);
+void dump_loops();
+
+void register_paths(PathSite*, unsigned long long*, int);
+void profile_path(unsigned long long*, unsigned long long);
+void dump_paths();
+
+void register_coverage(CoverageSite*, unsigned char*, int);
+void dump_coverage();
+
 void dump_inst(char*);
 
 
@@ -0,0 +1,324 @@
+#include "llvm/Pass.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/Regex.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include "Instrument.h"
+#include "Estimate.h"
+
+#define DEBUG_TYPE "Estimate"
+
+static cl::opt<std::string> EstimateOutput("estimate-output",
+    cl::desc("File where the estimated counts are written"),
+    cl::init("estimate.csv"));
+
+static cl::opt<std::string> EstimateValidate("estimate-validate",
+    cl::desc("count.csv measured for this module, to compare with the estimate"),
+    cl::init(""));
+
+static cl::opt<std::string> EstimateReport("estimate-report",
+    cl::desc("File where the validation errors are appended"),
+    cl::init("estimate_error.csv"));
+
+/*
+  Columns of count.csv, in the order dump_csv writes them, with the
+  opcode counted in each one.
+*/
+static const char *columns[][2] = {
+  {"STORE", "store"}, {"LOAD", "load"}, {"CMP", "icmp"}, {"ADD", "add"},
+  {"SUB", "sub"}, {"MUL", "mul"}, {"UDIV", "udiv"}, {"SDIV", "sdiv"},
+  {"UREM", "urem"}, {"SREM", "srem"}, {"FADD", "fadd"}, {"FSUB", "fsub"},
+  {"FMUL", "fmul"}, {"FDIV", "fdiv"}, {"FCMP", "fcmp"}, {"AND", "and"},
+  {"OR", "or"}, {"XOR", "xor"}, {"BR", "br"}, {"CALL", "call"},
+  {"SELECT", "select"}, {"SHL", "shl"}, {"ASHR", "ashr"}, {"LSHR", "lshr"}
+};
+
+static const unsigned NUM_COLUMNS = sizeof(columns) / sizeof(columns[0]);
+
+static int column_of(const std::string &opcodeName){
+  for (unsigned i=0; i<NUM_COLUMNS; i++)
+    if (opcodeName == columns[i][1])
+      return i;
+  return -1;
+}
+
+void Estimate::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<BlockFrequencyInfoWrapperPass>();
+  AU.addRequired<LoopInfoWrapperPass>();
+  AU.addRequired<ScalarEvolutionWrapperPass>();
+  AU.setPreservesAll();
+}
+
+void Estimate::block_weights(Function &F, std::map<BasicBlock*, double> &weights){
+  BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfoWrapperPass>(F).getBFI();
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+  ScalarEvolution &SE = getAnalysis<ScalarEvolutionWrapperPass>(F).getSE();
+
+  double entry = BFI.getEntryFreq();
+
+  for (auto &BB : F)
+    weights[&BB] = BFI.getBlockFreq(&BB).getFrequency() / entry;
+
+  /*
+    BFI guesses how many times a loop iterates from the probability of its
+    back edges. When SCEV knows the trip count, we rescale the blocks of the
+    loop so that the header runs exactly that many times per entry. The
+    factors are computed from the unscaled weights, so nested loops compose.
+  */
+  std::vector<std::pair<Loop*, double> > factors;
+  std::vector<Loop*> worklist(LI.begin(), LI.end());
+
+  while (!worklist.empty()){
+    Loop *L = worklist.back();
+    worklist.pop_back();
+    worklist.insert(worklist.end(), L->begin(), L->end());
+
+    BasicBlock *preheader = L->getLoopPreheader();
+    unsigned tripCount = SE.getSmallConstantTripCount(L);
+    if (!preheader || tripCount == 0 || weights[preheader] == 0)
+      continue;
+
+    double guessed = weights[L->getHeader()] / weights[preheader];
+    if (guessed > 0)
+      factors.push_back(std::make_pair(L, tripCount / guessed));
+  }
+
+  for (auto &f : factors)
+    for (BasicBlock *BB : f.first->blocks())
+      weights[BB] *= f.second;
+}
+
+void Estimate::function_weights(Module &M,
+    std::map<Function*, std::map<BasicBlock*, double> > &blocks,
+    std::map<Function*, double> &functions){
+
+  Function *main = M.getFunction("main");
+
+  // Without a main (a library, for instance), every function runs once
+  if (!main || main->isDeclaration()){
+    for (auto &it : blocks)
+      functions[it.first] = 1.0;
+    return;
+  }
+
+  // Reverse post-order of the direct calls reachable from main
+  std::vector<Function*> postorder;
+  std::set<Function*> visited;
+  std::vector<std::pair<Function*, std::vector<Function*> > > stack;
+
+  auto callees = [](Function *F){
+    std::vector<Function*> result;
+    for (auto &BB : *F)
+      for (auto &I : BB)
+        if (CallSite CS = CallSite(&I))
+          if (Function *callee = CS.getCalledFunction())
+            if (!callee->isDeclaration())
+              result.push_back(callee);
+    return result;
+  };
+
+  visited.insert(main);
+  stack.push_back(std::make_pair(main, callees(main)));
+  while (!stack.empty()){
+    auto &top = stack.back();
+    if (top.second.empty()){
+      postorder.push_back(top.first);
+      stack.pop_back();
+      continue;
+    }
+
+    Function *next = top.second.back();
+    top.second.pop_back();
+    if (visited.insert(next).second)
+      stack.push_back(std::make_pair(next, callees(next)));
+  }
+
+  std::map<Function*, unsigned> order;
+  for (unsigned i=0; i<postorder.size(); i++)
+    order[postorder[i]] = postorder.size() - i;
+
+  functions[main] = 1.0;
+  for (auto it = postorder.rbegin(); it != postorder.rend(); ++it){
+    Function *F = *it;
+    for (auto &BB : *F){
+      for (auto &I : BB){
+        // Invokes too, their normal destination runs as often as the call
+        CallSite CS(&I);
+        if (!CS)
+          continue;
+
+        Function *callee = CS.getCalledFunction();
+        if (!callee || callee->isDeclaration())
+          continue;
+
+        // A call to a function that comes earlier in the order is recursive
+        if (order[callee] <= order[F])
+          continue;
+
+        functions[callee] += functions[F] * blocks[F][&BB];
+      }
+    }
+  }
+}
+
+void Estimate::write_csv(const std::string &filename, const std::vector<double> &counts){
+  std::error_code EC;
+  raw_fd_ostream out(filename, EC, sys::fs::F_None);
+  if (EC){
+    errs() << "Cannot create file " << filename << "\n";
+    return;
+  }
+
+  for (unsigned i=0; i<NUM_COLUMNS; i++)
+    out << (i ? "," : "") << columns[i][0];
+  out << "\n";
+
+  for (unsigned i=0; i<NUM_COLUMNS; i++)
+    out << (i ? "," : "") << (unsigned long long)std::llround(counts[i]);
+  out << "\n";
+}
+
+void Estimate::validate(Module &M, const std::string &measured,
+    const std::vector<double> &counts){
+
+  std::ifstream in(measured);
+  std::string header, values;
+  if (!std::getline(in, header) || !std::getline(in, values)){
+    errs() << "Cannot read " << measured << "\n";
+    return;
+  }
+
+  // Match the columns by name, count.csv may have a different layout
+  std::vector<std::string> names, fields;
+  std::string field;
+  std::stringstream h(header), v(values);
+  while (std::getline(h, field, ','))
+    names.push_back(field);
+  while (std::getline(v, field, ','))
+    fields.push_back(field);
+
+  // A malformed field leaves its column out of the report
+  std::vector<double> real(NUM_COLUMNS, 0.0);
+  std::vector<bool> known(NUM_COLUMNS, false);
+  for (unsigned i=0; i<names.size() && i<fields.size(); i++){
+    for (unsigned c=0; c<NUM_COLUMNS; c++){
+      if (names[i] != columns[c][0])
+        continue;
+
+      const char *start = fields[i].c_str();
+      char *end;
+      double value = std::strtod(start, &end);
+      while (*end == ' ' || *end == '\r')
+        ++end;
+      if (end == start || *end != '\0'){
+        errs() << "Estimate: " << measured << ": ignoring " << names[i]
+               << ", it is not a number: " << fields[i] << "\n";
+        continue;
+      }
+      real[c] = value;
+      known[c] = true;
+    }
+  }
+
+  double diff = 0.0, total = 0.0;
+  for (unsigned c=0; c<NUM_COLUMNS; c++){
+    if (!known[c])
+      continue;
+    diff += std::fabs(counts[c] - real[c]);
+    total += real[c];
+  }
+
+  bool exists = sys::fs::exists(EstimateReport);
+  std::error_code EC;
+  raw_fd_ostream out(EstimateReport, EC, sys::fs::F_Append);
+  if (EC){
+    errs() << "Cannot create file " << EstimateReport << "\n";
+    return;
+  }
+
+  if (!exists){
+    out << "BENCHMARK,TOTAL";
+    for (unsigned c=0; c<NUM_COLUMNS; c++)
+      out << "," << columns[c][0];
+    out << "\n";
+  }
+
+  // Relative errors; empty when the measured count is zero
+  out << M.getModuleIdentifier() << ",";
+  if (total > 0)
+    out << diff / total;
+  for (unsigned c=0; c<NUM_COLUMNS; c++){
+    out << ",";
+    if (known[c] && real[c] > 0)
+      out << std::fabs(counts[c] - real[c]) / real[c];
+  }
+  out << "\n";
+}
+
+bool Estimate::runOnModule(Module &M) {
+
+  std::map<Function*, std::map<BasicBlock*, double> > blocks;
+  std::map<Function*, double> functions;
+
+  for (auto &F : M){
+    if (F.isDeclaration())
+      continue;
+    block_weights(F, blocks[&F]);
+  }
+
+  function_weights(M, blocks, functions);
+
+  std::vector<double> counts(NUM_COLUMNS, 0.0);
+  int br = column_of("br");
+
+  for (auto &F : M){
+    if (F.isDeclaration() || functions[&F] == 0)
+      continue;
+
+    for (auto &BB : F){
+      double weight = functions[&F] * blocks[&F][&BB];
+
+      for (auto &I : BB){
+        if (!Instrument::is_counted(&I))
+          continue;
+        int c = column_of(Instrument::counter_name(&I));
+        if (c >= 0)
+          counts[c] += weight;
+      }
+
+      // The Instrument pass counts a branch on each merge block
+      if (std::distance(pred_begin(&BB), pred_end(&BB)) >= 2)
+        counts[br] += weight;
+    }
+  }
+
+  write_csv(EstimateOutput, counts);
+
+  if (!EstimateValidate.empty())
+    validate(M, EstimateValidate, counts);
+
+  return false;
+}
+
+char Estimate::ID = 0;
+static RegisterPass<Estimate> Y("Estimate",
+    "Estimate the dynamic opcode counts without running the program",
+    false, true);
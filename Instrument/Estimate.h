@@ -0,0 +1,49 @@
+#pragma once
+
+using namespace llvm;
+
+/*
+  Analysis-only companion of the Instrument pass. Instead of running the
+  program, it estimates the values that count.csv would contain using the
+  static block frequencies (BlockFrequencyInfo, which is built on top of
+  BranchProbabilityInfo), corrected with the SCEV trip count of the loops
+  where it is known.
+*/
+class Estimate : public ModulePass {
+  public:
+  // Pass identifier, for LLVM's RTTI support:
+  static char ID;
+
+  bool runOnModule(Module&);
+  void getAnalysisUsage(AnalysisUsage &AU) const;
+
+  /*
+    Number of times each block of F runs for each invocation of F
+  */
+  void block_weights(Function &F, std::map<BasicBlock*, double> &weights);
+
+  /*
+    Number of invocations of each function when the program runs once.
+    `main` runs once, and its callees are visited in reverse post-order
+    of the call graph. Recursive calls are ignored.
+  */
+  void function_weights(Module &M,
+    std::map<Function*, std::map<BasicBlock*, double> > &blocks,
+    std::map<Function*, double> &functions);
+
+  /*
+    Writes the estimated counts in the format of count.csv
+  */
+  void write_csv(const std::string &filename, const std::vector<double> &counts);
+
+  /*
+    Compares the estimate with a count.csv measured by running the
+    instrumented program and appends the relative error to the report.
+  */
+  void validate(Module &M, const std::string &measured,
+    const std::vector<double> &counts);
+
+  Estimate() : ModulePass(ID) {}
+  ~Estimate() { }
+
+};
@@ -4,25 +4,179 @@
 #include "llvm/ADT/Statistic.h"        // For the STATISTIC macro.
 #include "llvm/IR/InstIterator.h"      // To use the iterator instructions(f)
 #include "llvm/IR/Instructions.h"      // To have access to the Instructions.
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/Constants.h"         // For ConstantData, for instance.
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Support/raw_ostream.h"  // For dbgs()
 #include "llvm/Analysis/VectorUtils.h"
 #include "llvm/IR/DebugInfoMetadata.h" // For DILocation
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/ADT/PostOrderIterator.h"
 #include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/IR/Metadata.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h" // For appendToGlobalCtors
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
 
-#include "Instrument.h"
-
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 #include <map>
+#include <set>
+#include <tuple>
+#include <vector>
+
+#include "Instrument.h"
 
 #define DEBUG_TYPE "Instrument"
 #define COUNTER "DCC888_counter"
 
-std::map<std::string, Value*> variables;
-std::map<std::string, Value*> count_variables;
+/*
+  The analyses of the function being instrumented, built once for all the
+  modes. In a module pass, each getAnalysis<...>(F) runs every required
+  function pass on F again.
+*/
+struct FunctionAnalyses {
+  DominatorTree DT;
+  PostDominatorTree PDT;
+  LoopInfo LI;
+  ScalarEvolution SE;
+
+  FunctionAnalyses(Function &F, TargetLibraryInfo &TLI, AssumptionCache &AC)
+    : DT(F), LI(DT), SE(F, TLI, AC, DT, LI) {
+    PDT.recalculate(F);
+  }
+};
+
+static cl::opt<bool> CountLines("instrument-lines",
+    cl::desc("Also count the instrumented opcodes per source line (lines.csv)"),
+    cl::init(false));
+
+static cl::opt<bool> ShareCounters("instrument-share-counters",
+    cl::desc("Update the counters once per group of control-equivalent blocks"),
+    cl::init(true));
+
+static cl::opt<bool> WholeProgram("instrument-whole-program",
+    cl::desc("The module is the whole program: keep all counters in one "
+             "dense array and skip the functions that are never called"),
+    cl::init(false));
+
+static cl::opt<bool> UseIntrinsics("instrument-intrinsics",
+    cl::desc("Emit the counter updates as calls to " INCREMENT ", to be "
+             "lowered by -InstrumentLower after optimization"),
+    cl::init(false));
+
+static cl::opt<bool> ProfileValues("instrument-values",
+    cl::desc("Record the most frequent divisors, shift amounts and select "
+             "conditions (values.csv)"),
+    cl::init(false));
+
+static cl::opt<bool> ProfileBranches("instrument-branches",
+    cl::desc("Count the function entries and the edges taken by each "
+             "conditional branch and switch (branches.csv)"),
+    cl::init(false));
+
+static cl::opt<bool> ProfileCalls("instrument-calls",
+    cl::desc("Count each call site and record the targets of indirect "
+             "calls (calls.csv)"),
+    cl::init(false));
+
+static cl::opt<bool> TimeReport("instrument-time-report",
+    cl::desc("Print the time spent by the pass on each module, per 100k "
+             "instructions"),
+    cl::init(false));
+
+static cl::opt<bool> ProfileCycles("instrument-cycles",
+    cl::desc("Measure the inclusive and exclusive cycles of each function "
+             "with the cycle counter (cycles.csv)"),
+    cl::init(false));
+
+static cl::opt<bool> ProfileILP("instrument-ilp",
+    cl::desc("Measure the critical path of each invocation with ready times "
+             "of the values and memory words, and the available ILP "
+             "(ilp.csv)"),
+    cl::init(false));
+
+static cl::opt<bool> ProfileCost("instrument-cost",
+    cl::desc("Weight the counted instructions with the throughput and "
+             "latency costs of the target (cost.csv)"),
+    cl::init(false));
+
+static cl::opt<bool> ProfileMemory("instrument-memory",
+    cl::desc("Count the bytes loaded and stored by each function, and profile "
+             "the allocations (memory.csv, allocs.csv)"),
+    cl::init(false));
+
+static cl::opt<bool> ProfileSanitizers("instrument-sanitizers",
+    cl::desc("Split the counts into user code and the checks of each "
+             "sanitizer runtime function, for modules built with "
+             "-fsanitize (sanitizers.csv)"),
+    cl::init(false));
+
+static cl::opt<bool> Coverage("instrument-coverage",
+    cl::desc("Only record which blocks run, with a byte per block instead of "
+             "the opcode counters (coverage.bin)"),
+    cl::init(false));
+
+static cl::opt<bool> ProfileStrides("instrument-strides",
+    cl::desc("Profile the address strides of the loads and stores in "
+             "loops (strides.csv)"),
+    cl::init(false));
+
+static cl::opt<bool> ProfileLoops("instrument-loops",
+    cl::desc("Record a log2 histogram of the trip counts of each loop "
+             "(loops.csv)"),
+    cl::init(false));
+
+static cl::opt<bool> ProfilePaths("instrument-paths",
+    cl::desc("Count the acyclic paths taken in each function, numbered as "
+             "in Ball-Larus (paths.csv, paths.graph)"),
+    cl::init(false));
+
+static cl::opt<unsigned> PathSlots("instrument-path-slots",
+    cl::desc("Functions with more acyclic paths than this count them in a "
+             "hash table instead of an array"),
+    cl::init(4096));
+
+static cl::list<std::string> InstrumentOnly("instrument-only",
+    cl::desc("Instrument only the functions whose name matches one of "
+             "these regular expressions"),
+    cl::CommaSeparated);
+
+static cl::list<std::string> InstrumentSkip("instrument-skip",
+    cl::desc("Do not instrument the functions whose name matches one of "
+             "these regular expressions"),
+    cl::CommaSeparated);
+
+static cl::opt<std::string> HotProfile("instrument-hot-profile",
+    cl::desc("Profile of a previous run, one function per line with its "
+             "name in the first column and its weight in the last one. "
+             "Only the hottest functions are instrumented"),
+    cl::init(""));
+
+static cl::opt<unsigned> HotFunctions("instrument-hot-functions",
+    cl::desc("Number of functions instrumented with -instrument-hot-profile"),
+    cl::init(10));
+
+void Instrument::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<AssumptionCacheTracker>();
+  AU.addRequired<TargetLibraryInfoWrapperPass>();
+  AU.addRequired<TargetTransformInfoWrapperPass>();
+}
 
 void Instrument::print_instructions(Module &M){
   for (auto &F : M){
@@ -41,41 +195,46 @@ Value* Instrument::alloc_string(Instruction *I){
   A variable is just a char* with some text identifying the instruction.
   For instance, we use the getOpcodeName() function.
   */
-  const std::string opcodeName = I->getOpcodeName();
+  return alloc_global_string(*I->getModule(), I->getOpcodeName());
+}
 
-  // If we already create a variable for the opcodeName, let's just return it
-  if (variables.find(opcodeName) != variables.end())
-    return variables[opcodeName];
 
-  // Otherwise, let's create one
-  IRBuilder<> Builder(I);
-  Value *var = Builder.CreateGlobalStringPtr(StringRef(opcodeName));
-  variables[opcodeName] = var;
+Value* Instrument::alloc_counter(Module &M, Instruction *I, bool branch=false){
 
-  return var;
-}
+  // Invokes are counted as calls, see counter_name
+  unsigned opcode = I->getOpcode();
+  if (branch)
+    opcode = Instruction::Br;
+  else if (isa<InvokeInst>(I))
+    opcode = Instruction::Call;
 
+  Value *&counter = opcode_counters[opcode];
+  if (counter)
+    return counter;
 
-Value* Instrument::alloc_counter(Module &M, Instruction *I, bool branch=false){
-  
   std::string opcodeName;
   if (!branch)
-    opcodeName = I->getOpcodeName();
+    opcodeName = counter_name(I);
   else
     opcodeName = "br";
-  
-  IRBuilder<> Builder(I);
 
-  M.getOrInsertGlobal(opcodeName + "_inc", Builder.getInt64Ty());
-  
-  GlobalVariable *gVar = M.getNamedGlobal(opcodeName + "_inc"); 
-  return gVar;
+  if (dense)
+    counter = alloc_dense_counter(M, opcodeName + "_inc");
+  else
+    counter = M.getOrInsertGlobal(opcodeName + "_inc",
+      Type::getInt64Ty(M.getContext()));
+
+  return counter;
 }
 
 
 void Instrument::insert_dump_call(Module &M, Instruction *I){
   IRBuilder<> Builder(I);
 
+  // The runtime only knows the `<opcode>_inc` globals
+  if (dense)
+    Builder.CreateCall(get_flush(M), std::vector<Value*>());
+
   // Let's create the function call
   Constant *const_function = M.getOrInsertFunction("dump_csv",
     FunctionType::getVoidTy(M.getContext()));
@@ -111,104 +270,2322 @@ void Instrument::insert_call(Module &M, Instruction *I){
   Builder.CreateCall(f, args);
 }
 
-void Instrument::insert_inc(Module &M, Instruction *I, bool branch=false){
+Function* Instrument::get_increment(Module &M){
+  LLVMContext &C = M.getContext();
 
-  alloc_counter(M, I, branch);
+  Constant *const_function = M.getOrInsertFunction(INCREMENT,
+    Type::getVoidTy(C),
+    Type::getInt64PtrTy(C),
+    Type::getInt64Ty(C),
+    nullptr);
 
-  GlobalVariable *gVar;
+  // It only writes its argument, so it is transparent to the rest of the code
+  Function *f = cast<Function>(const_function);
+  f->addFnAttr(Attribute::NoUnwind);
+  f->addFnAttr(Attribute::ArgMemOnly);
+  return f;
+}
 
-  if (!branch)
-    gVar = M.getNamedGlobal(std::string(I->getOpcodeName()) + "_inc");
-  else{
-    gVar = M.getNamedGlobal("br_inc");
-  }
-  
+void Instrument::insert_counter_inc(Instruction *I, Value *ptr, uint64_t amount){
+  insert_counter_inc(I, ptr, ConstantInt::get(Type::getInt64Ty(I->getContext()),
+    amount));
+}
+
+void Instrument::insert_counter_inc(Instruction *I, Value *ptr, Value *amount){
   IRBuilder<> Builder(I);
 
-  // if (branch)
-    // errs() << "passou " << *gVar << " AAA\n";
+  if (UseIntrinsics){
+    Value *args[] = {ptr, amount};
+    Builder.CreateCall(get_increment(*I->getModule()), args);
+    return;
+  }
 
-  LoadInst *Load = Builder.CreateLoad(gVar);
-  Value *Inc = Builder.CreateAdd(Builder.getInt64(1), Load);
-  StoreInst *Store = Builder.CreateStore(Inc, gVar);
+  LoadInst *Load = Builder.CreateLoad(ptr);
+  Value *Inc = Builder.CreateAdd(amount, Load);
+  Builder.CreateStore(Inc, ptr);
+}
 
+Constant* Instrument::counter_slot(GlobalVariable *array, unsigned slot){
+  Type *i64 = Type::getInt64Ty(array->getContext());
+  Constant *indices[] = {ConstantInt::get(i64, 0), ConstantInt::get(i64, slot)};
+  return ConstantExpr::getInBoundsGetElementPtr(array->getValueType(), array,
+    indices);
 }
 
-int Instrument::getNumPredecessors(BasicBlock *BB){
-  int cnt = 0;
+void Instrument::count_inc(Module &M, Histogram &hist, Instruction *I,
+    bool branch=false){
+
+  Constant *line = nullptr;
+  if (CountLines){
+    auto it = line_slots.find(I);
+    if (it != line_slots.end())
+      line = counter_slot(line_counters, it->second);
+  }
+
+  // Call sites run as often as their block, so they share its update
+  Constant *call = nullptr;
+  if (ProfileCalls){
+    auto it = call_slots.find(I);
+    if (it != call_slots.end())
+      call = counter_slot(call_counters, it->second);
+  }
+
+  std::vector<std::pair<Value*, uint64_t> > updates;
+  updates.push_back(std::make_pair(alloc_counter(M, I, branch), 1));
+  if (line)
+    updates.push_back(std::make_pair(line, 1));
+  if (call)
+    updates.push_back(std::make_pair(call, 1));
+
+  // Executions, throughput and latency of the (function, opcode) pair
+  if (ProfileCost && !branch){
+    auto it = costs.find(I);
+    if (it != costs.end()){
+      unsigned slot, throughput, latency;
+      std::tie(slot, throughput, latency) = it->second;
+      updates.push_back(std::make_pair(counter_slot(cost_counters, 3*slot), 1));
+      if (throughput)
+        updates.push_back(std::make_pair(
+          counter_slot(cost_counters, 3*slot + 1), throughput));
+      if (latency)
+        updates.push_back(std::make_pair(
+          counter_slot(cost_counters, 3*slot + 2), latency));
+    }
+  }
+
+  // Accesses and bytes moved by the function
+  if (ProfileMemory){
+    auto it = memory_ops.find(I);
+    if (it != memory_ops.end()){
+      unsigned slot, bytes;
+      std::tie(slot, bytes) = it->second;
+      unsigned base = 4*slot + (isa<StoreInst>(I) ? 2 : 0);
+      updates.push_back(std::make_pair(counter_slot(memory_counters, base), 1));
+      updates.push_back(std::make_pair(
+        counter_slot(memory_counters, base + 1), bytes));
+    }
+  }
+
+  // The opcode as user code or as part of a sanitizer check
+  if (ProfileSanitizers){
+    auto it = sanitizer_slots.find(std::make_pair(I, branch));
+    if (it != sanitizer_slots.end())
+      updates.push_back(std::make_pair(
+        counter_slot(sanitizer_counters, it->second), 1));
+  }
+
+  if (!ShareCounters){
+    for (auto &u : updates)
+      insert_counter_inc(I, u.first, u.second);
+    return;
+  }
+
+  for (auto &u : updates)
+    hist[u.first] += u.second;
+}
+
+void Instrument::insert_histogram(BasicBlock *BB, Histogram &hist){
+  BasicBlock::iterator it = BB->getFirstInsertionPt();
+
+  // catchswitch blocks have no place for non-PHI instructions
+  if (it == BB->end())
+    return;
+
+  for (auto &entry : hist)
+    insert_counter_inc(&*it, entry.first, entry.second);
+}
+
+void Instrument::equivalence_classes(Function &F,
+    std::map<BasicBlock*, BasicBlock*> &leaders){
+
+  for (auto &BB : F)
+    leaders[&BB] = &BB;
+
+  if (!ShareCounters)
+    return;
+
+  DominatorTree &DT = analyses->DT;
+  PostDominatorTree &PDT = analyses->PDT;
+  LoopInfo &LI = analyses->LI;
+
+  /*
+    A and B are control-equivalent when A dominates B, B post-dominates A
+    and both are in the same loop: every time A runs, B runs once. Blocks
+    are visited in dominator-tree pre-order, so the leader of a class is
+    the block of the class that dominates the others, and it is always
+    visited before them. We only need to look at the leaders among the
+    dominators of BB that are inside its loop.
+  */
+  for (DomTreeNode *node : depth_first(DT.getRootNode())){
+    BasicBlock *BB = node->getBlock();
+    Loop *L = LI.getLoopFor(BB);
+
+    for (DomTreeNode *dom = node->getIDom(); dom; dom = dom->getIDom()){
+      BasicBlock *A = dom->getBlock();
+
+      if (L && !L->contains(A))
+        break;
+
+      if (leaders[A] != A || LI.getLoopFor(A) != L)
+        continue;
+
+      if (PDT.dominates(BB, A)){
+        leaders[BB] = A;
+        break;
+      }
+    }
+  }
+}
+
+void Instrument::instrument_function(Module &M, Function &F){
+  std::map<BasicBlock*, BasicBlock*> leaders;
+  equivalence_classes(F, leaders);
+
+  MapVector<BasicBlock*, Histogram> histograms;
+
+  for (auto &BB : F){
+    Histogram &hist = histograms[leaders[&BB]];
+
+    for (auto &I : BB){
+        
+      if (StoreInst *store = dyn_cast<StoreInst>(&I)){
+        // insert_call(M, store);
+        count_inc(M, hist, store);
+      }
+      else if (LoadInst *load = dyn_cast<LoadInst>(&I)){
+        // insert_call(M, load);
+        count_inc(M, hist, load);
+      }
+      else if (BinaryOperator *bin = dyn_cast<BinaryOperator>(&I)){
+        // insert_call(M, bin);
+        count_inc(M, hist, bin);
+      }
+      else if (ICmpInst *icmp = dyn_cast<ICmpInst>(&I)){
+        // insert_call(M, icmp);
+        count_inc(M, hist, icmp);
+      }
+      else if (FCmpInst *fcmp = dyn_cast<FCmpInst>(&I)){
+        // insert_call(M, fcmp);
+        count_inc(M, hist, fcmp);
+      }
+      // else if (BranchInst *br = dyn_cast<BranchInst>(&I)){
+      //   // insert_call(M, br);
+      // }
+      // else if (IndirectBrInst *bri = dyn_cast<IndirectBrInst>(&I)){
+      //   // insert_call(M, bri);
+      // }
+      else if (CallInst *ci = dyn_cast<CallInst>(&I)){
+        count_inc(M, hist, ci);
+      }
+      else if (InvokeInst *ii = dyn_cast<InvokeInst>(&I)){
+        count_inc(M, hist, ii);
+      }
+      else if(SelectInst *si = dyn_cast<SelectInst>(&I)){
+        count_inc(M, hist, si);
+      }
+
+    }
+
+    Instruction *T = BB.getTerminator();
+    if (getNumPredecessors(&BB) >= 2)
+      count_inc(M, hist, T, true);
+    else if (CountLines && line_slots.count(T)){
+      // The other branches only count for their line
+      Constant *line = counter_slot(line_counters, line_slots[T]);
+      if (ShareCounters)
+        hist[line] += 1;
+      else
+        insert_counter_inc(T, line, 1);
+    }
+  }
+
+  for (auto &it : histograms)
+    insert_histogram(it.first, it.second);
+}
+
+void Instrument::insert_dump_calls(Module &M, Function &F){
+  std::vector<Instruction*> exits;
+
+  for (auto &BB : F){
+    for (auto &I : BB){
+      if (isa<ReturnInst>(&I)){
+        if (F.getName() == "main")
+          exits.push_back(&I);
+      }
+      else if (CallInst *ci = dyn_cast<CallInst>(&I)){
+        Function *fun = ci->getCalledFunction();
+        if (fun && fun->getName() == "exit")
+          exits.push_back(&I);
+      }
+    }
+  }
+
+  for (Instruction *I : exits)
+    insert_dump_call(M, I);
+}
+
+Instruction* Instrument::before_dump(Instruction *I){
+  while (CallInst *ci = dyn_cast_or_null<CallInst>(I->getPrevNode())){
+    Function *callee = ci->getCalledFunction();
+    if (!ci->isMustTailCall() && (!callee ||
+        (callee->getName() != "dump_csv" && callee != flush)))
+      break;
+    I = ci;
+  }
+  return I;
+}
+
+void Instrument::select_functions(Module &M){
+  only.clear();
+  skip.clear();
+  hot.clear();
+
+  std::string error;
+  for (auto &pattern : InstrumentOnly){
+    Regex R(pattern);
+    if (R.isValid(error))
+      only.push_back(std::move(R));
+    else
+      errs() << "Instrument: ignoring -instrument-only " << pattern << ": "
+             << error << "\n";
+  }
+  for (auto &pattern : InstrumentSkip){
+    Regex R(pattern);
+    if (R.isValid(error))
+      skip.push_back(std::move(R));
+    else
+      errs() << "Instrument: ignoring -instrument-skip " << pattern << ": "
+             << error << "\n";
+  }
+
+  if (HotProfile.empty())
+    return;
+
+  std::ifstream in(HotProfile);
+  if (!in){
+    errs() << "Cannot read " << HotProfile << "\n";
+    return;
+  }
+
+  // Headers and other lines without a numeric weight are skipped
+  std::map<std::string, double> weights;
+  std::string line;
+  while (std::getline(in, line)){
+    size_t first = line.find(',');
+    size_t last = line.rfind(',');
+    if (first == std::string::npos)
+      continue;
+
+    std::string name = StringRef(line.substr(0, first)).trim();
+    StringRef weight = StringRef(line).substr(last + 1).trim();
+    double w;
+    if (weight.getAsDouble(w))
+      continue;
+    weights[name] += w;
+  }
+
+  std::vector<std::pair<double, std::string> > sorted;
+  for (auto &it : weights)
+    sorted.push_back(std::make_pair(it.second, it.first));
+  std::sort(sorted.rbegin(), sorted.rend());
+
+  for (unsigned i=0; i<sorted.size() && i<HotFunctions; i++)
+    hot.insert(sorted[i].second);
+}
+
+bool Instrument::should_instrument(Function &F){
+  std::string name = F.getName();
+
+  if (!HotProfile.empty() && hot.find(name) == hot.end())
+    return false;
+
+  for (auto &R : skip)
+    if (R.match(name))
+      return false;
+
+  if (only.empty())
+    return true;
+
+  for (auto &R : only)
+    if (R.match(name))
+      return true;
+
+  return false;
+}
+
+Constant* Instrument::alloc_global_string(Module &M, StringRef str){
   
-  for (BasicBlock *Pred : predecessors(BB))
-    cnt++;
+  auto it = strings.find(str.str());
+  if (it != strings.end())
+    return it->second;
 
-  return cnt;
+  LLVMContext &C = M.getContext();
+  Constant *data = ConstantDataArray::getString(C, str);
+  GlobalVariable *gVar = new GlobalVariable(M, data->getType(), true,
+    GlobalValue::PrivateLinkage, data, ".str");
+  gVar->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+
+  Constant *zero = ConstantInt::get(Type::getInt32Ty(C), 0);
+  Constant *indices[] = {zero, zero};
+  Constant *ptr = ConstantExpr::getInBoundsGetElementPtr(data->getType(),
+    gVar, indices);
+
+  strings[str.str()] = ptr;
+  return ptr;
 }
 
+void Instrument::insert_ctor_call(Module &M, const std::string &name,
+    ArrayRef<Value*> args){
 
-bool Instrument::runOnModule(Module &M) {
+  if (!ctor){
+    ctor = Function::Create(
+      FunctionType::get(Type::getVoidTy(M.getContext()), false),
+      GlobalValue::InternalLinkage, "basilisk_ctor", &M);
+    ReturnInst::Create(M.getContext(),
+      BasicBlock::Create(M.getContext(), "entry", ctor));
+    appendToGlobalCtors(M, ctor, 0);
+  }
+
+  std::vector<Type*> params;
+  for (Value *v : args)
+    params.push_back(v->getType());
+
+  Constant *const_function = M.getOrInsertFunction(name,
+    FunctionType::get(Type::getVoidTy(M.getContext()), params, false));
+
+  Function *f = cast<Function>(const_function);
+
+  IRBuilder<> Builder(ctor->getEntryBlock().getTerminator());
+  Builder.CreateCall(f, args);
+}
+
+bool Instrument::is_instrumented(Module &M){
+  for (auto &F : M){
+    // Merged modules keep their constructors, renamed basilisk_ctor.<n>
+    if (F.getName().startswith("basilisk_ctor"))
+      return true;
+    if (F.isDeclaration() && F.getName().startswith("register_") &&
+        !F.use_empty())
+      return true;
+  }
+
+  for (unsigned op=1; op<Instruction::OtherOpsEnd; op++)
+    if (M.getNamedGlobal(std::string(Instruction::getOpcodeName(op)) + "_inc"))
+      return true;
+  return false;
+}
+
+bool Instrument::is_counted(Instruction *I){
+  return isa<StoreInst>(I) || isa<LoadInst>(I) || isa<BinaryOperator>(I) ||
+         isa<ICmpInst>(I) || isa<FCmpInst>(I) || isa<CallInst>(I) ||
+         isa<InvokeInst>(I) || isa<SelectInst>(I);
+}
+
+std::string Instrument::counter_name(Instruction *I){
+  // The runtime has a single counter for both kinds of call
+  if (isa<InvokeInst>(I))
+    return "call";
+  return I->getOpcodeName();
+}
+
+void Instrument::collect_lines(Module &M){
+  LLVMContext &C = M.getContext();
+
+  /*
+    Each (file, line, opcode) triple gets one slot in the line_counters array.
+    Sites are collected before anything is inserted, so that the counters
+    we add are never mistaken for instructions of the program.
+  */
+  std::map<std::tuple<std::string, unsigned, std::string>, unsigned> slots;
+
+  Type *i32 = Type::getInt32Ty(C);
+  Type *i8ptr = Type::getInt8PtrTy(C);
+  StructType *siteTy = StructType::get(i8ptr, i32, i8ptr, nullptr);
 
   for (auto &F : M){
     for (auto &BB : F){
       for (auto &I : BB){
+        std::string opcodeName;
+        if (is_counted(&I))
+          opcodeName = counter_name(&I);
+        else if (isa<BranchInst>(&I) || isa<SwitchInst>(&I) ||
+                 isa<IndirectBrInst>(&I))
+          opcodeName = "br";  // every branch, like BR in PinLib/CountLines
+        else
+          continue;
+
+        DILocation *loc = I.getDebugLoc().get();
+        if (!loc || loc->getLine() == 0)
+          continue;
+
+        auto key = std::make_tuple(loc->getFilename().str(), loc->getLine(),
+          opcodeName);
         
-        if (StoreInst *store = dyn_cast<StoreInst>(&I)){
-          // insert_call(M, store);
-          insert_inc(M, store);
-        }
-        else if (LoadInst *load = dyn_cast<LoadInst>(&I)){
-          // insert_call(M, load);
-          insert_inc(M, load);
-        }
-        else if (BinaryOperator *bin = dyn_cast<BinaryOperator>(&I)){
-          // insert_call(M, bin);
-          insert_inc(M, bin);
-        }
-        else if (ICmpInst *icmp = dyn_cast<ICmpInst>(&I)){
-          // insert_call(M, icmp);
-          insert_inc(M, icmp);
-        }
-        else if (FCmpInst *fcmp = dyn_cast<FCmpInst>(&I)){
-          // insert_call(M, fcmp);
-          insert_inc(M, fcmp);
-        }
-        // else if (BranchInst *br = dyn_cast<BranchInst>(&I)){
-        //   // insert_call(M, br);
-        // }
-        // else if (IndirectBrInst *bri = dyn_cast<IndirectBrInst>(&I)){
-        //   // insert_call(M, bri);
-        // }
-        else if (ReturnInst *ri = dyn_cast<ReturnInst>(&I)){
-          if (F.getName() == "main")
-            insert_dump_call(M, ri);
-        }
-        else if (CallInst *ci = dyn_cast<CallInst>(&I)){
-          insert_inc(M, ci);
-          Function *fun = ci->getCalledFunction();
-          if (fun){
-            std::string name = fun->getName();
-            if (name == "exit")
-              insert_dump_call(M, ci);
-          }
-        }
-        else if(SelectInst *si = dyn_cast<SelectInst>(&I)){
-          insert_inc(M, si);
+        if (slots.find(key) == slots.end()){
+          slots[key] = line_descriptors.size();
+          line_descriptors.push_back(ConstantStruct::get(siteTy,
+            alloc_global_string(M, loc->getFilename()),
+            ConstantInt::get(i32, loc->getLine()),
+            alloc_global_string(M, opcodeName),
+            nullptr));
         }
 
+        line_slots[&I] = slots[key];
       }
     }
   }
 
+  if (line_descriptors.empty())
+    return;
+
+  ArrayType *countersTy = ArrayType::get(Type::getInt64Ty(C),
+    line_descriptors.size());
+  line_counters = new GlobalVariable(M, countersTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(countersTy),
+    "line_counters");
+}
+
+void Instrument::register_lines(Module &M){
+  LLVMContext &C = M.getContext();
+
+  if (line_descriptors.empty())
+    return;
+
+  ArrayType *tableTy = ArrayType::get(line_descriptors[0]->getType(),
+    line_descriptors.size());
+  GlobalVariable *table = new GlobalVariable(M, tableTy, true,
+    GlobalValue::PrivateLinkage, ConstantArray::get(tableTy, line_descriptors),
+    "line_sites");
+
+  Value *args[] = {
+    ConstantExpr::getPointerCast(table, Type::getInt8PtrTy(C)),
+    ConstantExpr::getPointerCast(line_counters, Type::getInt64PtrTy(C)),
+    ConstantInt::get(Type::getInt32Ty(C), line_descriptors.size())
+  };
+  insert_ctor_call(M, "register_lines", args);
+}
+
+Value* Instrument::alloc_dense_counter(Module &M, const std::string &name){
+  auto it = dense_slots.find(name);
+  if (it != dense_slots.end())
+    return it->second;
+
+  // A placeholder, replaced by a slot of basilisk_counters in densify()
+  Type *i64 = Type::getInt64Ty(M.getContext());
+  GlobalVariable *gVar = new GlobalVariable(M, i64, false,
+    GlobalValue::PrivateLinkage, ConstantInt::get(i64, 0), name + ".slot");
+
+  dense_slots[name] = gVar;
+  return gVar;
+}
+
+Function* Instrument::get_flush(Module &M){
+  if (!flush){
+    flush = Function::Create(
+      FunctionType::get(Type::getVoidTy(M.getContext()), false),
+      GlobalValue::InternalLinkage, "basilisk_flush", &M);
+    ReturnInst::Create(M.getContext(),
+      BasicBlock::Create(M.getContext(), "entry", flush));
+  }
+  return flush;
+}
+
+void Instrument::live_functions(Module &M, std::set<Function*> &live){
+  std::vector<Function*> worklist;
+
+  // Anything whose address escapes may be called from anywhere
   for (auto &F : M){
-    for (auto &BB : F){
-      if (getNumPredecessors(&BB) >= 2){
-        Instruction *ins = BB.getTerminator();
-        insert_inc(M, ins, true);
+    if (!F.isDeclaration() && (F.getName() == "main" || F.hasAddressTaken())){
+      live.insert(&F);
+      worklist.push_back(&F);
+    }
+  }
+
+  while (!worklist.empty()){
+    Function *F = worklist.back();
+    worklist.pop_back();
+
+    for (auto &BB : *F){
+      for (auto &I : BB){
+        CallSite CS(&I);
+        if (!CS)
+          continue;
+
+        Function *callee = CS.getCalledFunction();
+        if (callee && !callee->isDeclaration() && live.insert(callee).second)
+          worklist.push_back(callee);
       }
     }
   }
+}
 
-  return true;
+void Instrument::densify(Module &M){
+  LLVMContext &C = M.getContext();
+  Type *i64 = Type::getInt64Ty(C);
+
+  unsigned n = dense_slots.size();
+  if (line_counters)
+    n += line_descriptors.size();
+
+  if (n == 0)
+    return;
+
+  ArrayType *countersTy = ArrayType::get(i64, n);
+  GlobalVariable *counters = new GlobalVariable(M, countersTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(countersTy),
+    "basilisk_counters");
+
+  IRBuilder<> Builder(get_flush(M)->getEntryBlock().getTerminator());
+
+  unsigned slot = 0;
+  for (auto &it : dense_slots){
+    GlobalVariable *placeholder = cast<GlobalVariable>(it.second);
+    Constant *ptr = counter_slot(counters, slot++);
+    placeholder->replaceAllUsesWith(ptr);
+    placeholder->eraseFromParent();
+
+    // Move the slot into the runtime counter, right before each dump
+    M.getOrInsertGlobal(it.first, i64);
+    GlobalVariable *gVar = M.getNamedGlobal(it.first);
+    Value *Inc = Builder.CreateAdd(Builder.CreateLoad(ptr),
+      Builder.CreateLoad(gVar));
+    Builder.CreateStore(Inc, gVar);
+    Builder.CreateStore(Builder.getInt64(0), ptr);
+  }
+
+  // The line counters keep their layout, as a slice of the dense array
+  if (line_counters){
+    line_counters->replaceAllUsesWith(ConstantExpr::getBitCast(
+      counter_slot(counters, slot), line_counters->getType()));
+    line_counters->eraseFromParent();
+    line_counters = nullptr;
+  }
 }
 
-char Instrument::ID = 0;
-static RegisterPass<Instrument> X("Instrument",
-    "Instrument");
\ No newline at end of file
+Constant* Instrument::alloc_site(Module &M, Instruction *I, StringRef kind){
+  LLVMContext &C = M.getContext();
+  Type *i8ptr = Type::getInt8PtrTy(C);
+  Type *i32 = Type::getInt32Ty(C);
+  StructType *siteTy = StructType::get(i8ptr, i8ptr, i32, i8ptr, nullptr);
+
+  StringRef file = "";
+  unsigned line = 0;
+  if (DILocation *loc = I->getDebugLoc().get()){
+    file = loc->getFilename();
+    line = loc->getLine();
+  }
+
+  return ConstantStruct::get(siteTy,
+    alloc_global_string(M, I->getFunction()->getName()),
+    alloc_global_string(M, file),
+    ConstantInt::get(i32, line),
+    alloc_global_string(M, kind),
+    nullptr);
+}
+
+void Instrument::register_table(Module &M, const std::string &name,
+    std::vector<Constant*> &sites, GlobalVariable *data){
+
+  LLVMContext &C = M.getContext();
+
+  if (sites.empty())
+    return;
+
+  ArrayType *tableTy = ArrayType::get(sites[0]->getType(), sites.size());
+  GlobalVariable *table = new GlobalVariable(M, tableTy, true,
+    GlobalValue::PrivateLinkage, ConstantArray::get(tableTy, sites),
+    "sites");
+
+  Value *args[] = {
+    ConstantExpr::getPointerCast(table, Type::getInt8PtrTy(C)),
+    ConstantExpr::getPointerCast(data, Type::getInt8PtrTy(C)),
+    ConstantInt::get(Type::getInt32Ty(C), sites.size())
+  };
+  insert_ctor_call(M, name, args);
+}
+
+GlobalVariable* Instrument::alloc_value_profiles(Module &M, unsigned n,
+    const std::string &name){
+
+  LLVMContext &C = M.getContext();
+  Type *i64 = Type::getInt64Ty(C);
+
+  // Layout of ValueProfile in Collect/collect.h
+  ArrayType *topTy = ArrayType::get(i64, VALUE_TOPK);
+  StructType *profileTy = StructType::get(topTy, topTy, topTy, i64,
+    ArrayType::get(Type::getInt8Ty(C), VALUE_TOPK), nullptr);
+
+  ArrayType *profilesTy = ArrayType::get(profileTy, n);
+  return new GlobalVariable(M, profilesTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(profilesTy),
+    name);
+}
+
+Function* Instrument::get_profile_value(Module &M){
+  LLVMContext &C = M.getContext();
+
+  Constant *const_function = M.getOrInsertFunction("profile_value",
+    Type::getVoidTy(C), Type::getInt8PtrTy(C), Type::getInt64Ty(C), nullptr);
+
+  return cast<Function>(const_function);
+}
+
+void Instrument::instrument_values(Module &M){
+  LLVMContext &C = M.getContext();
+  Type *i64 = Type::getInt64Ty(C);
+  Type *i8ptr = Type::getInt8PtrTy(C);
+
+  std::vector<std::pair<Instruction*, Value*> > sites;
+  std::vector<Constant*> descriptors;
+
+  for (Function *F : instrumented){
+    for (auto &BB : *F){
+      for (auto &I : BB){
+        Value *v = nullptr;
+        const char *kind = nullptr;
+
+        switch (I.getOpcode()){
+          case Instruction::UDiv:
+          case Instruction::SDiv:
+          case Instruction::URem:
+          case Instruction::SRem:
+            v = I.getOperand(1);
+            kind = "divisor";
+            break;
+          case Instruction::Shl:
+          case Instruction::LShr:
+          case Instruction::AShr:
+            v = I.getOperand(1);
+            kind = "shift";
+            break;
+          case Instruction::Select:
+            v = I.getOperand(0);
+            kind = "select";
+            break;
+        }
+
+        // Constants need no profile, and vectors do not fit in the table
+        if (!v || isa<Constant>(v) || !v->getType()->isIntegerTy() ||
+            v->getType()->getIntegerBitWidth() > 64)
+          continue;
+
+        sites.push_back(std::make_pair(&I, v));
+        descriptors.push_back(alloc_site(M, &I, kind));
+      }
+    }
+  }
+
+  if (sites.empty())
+    return;
+
+  GlobalVariable *profiles = alloc_value_profiles(M, sites.size(),
+    "value_profiles");
+  Function *f = get_profile_value(M);
+
+  for (unsigned i=0; i<sites.size(); i++){
+    Instruction *I = sites[i].first;
+    IRBuilder<> Builder(I);
+
+    Value *v = sites[i].second;
+    if (I->getOpcode() == Instruction::SDiv || I->getOpcode() == Instruction::SRem)
+      v = Builder.CreateSExtOrTrunc(v, i64);
+    else
+      v = Builder.CreateZExtOrTrunc(v, i64);
+
+    Value *args[] = {
+      ConstantExpr::getPointerCast(counter_slot(profiles, i), i8ptr), v
+    };
+    Builder.CreateCall(f, args);
+  }
+
+  register_table(M, "register_values", descriptors, profiles);
+}
+
+void Instrument::collect_calls(Module &M){
+  LLVMContext &C = M.getContext();
+
+  for (auto &F : M){
+    for (auto &BB : F){
+      for (auto &I : BB){
+        CallSite CS(&I);
+        if (!CS || isa<IntrinsicInst>(&I) || CS.isInlineAsm())
+          continue;
+
+        // Calls through a bitcast of a function are still direct
+        Value *callee = CS.getCalledValue()->stripPointerCasts();
+        if (Function *fun = dyn_cast<Function>(callee)){
+          call_slots[&I] = call_descriptors.size();
+          call_descriptors.push_back(alloc_site(M, &I, fun->getName()));
+        }
+        else {
+          indirect_calls.push_back(&I);
+        }
+      }
+    }
+  }
+
+  if (call_descriptors.empty())
+    return;
+
+  ArrayType *countersTy = ArrayType::get(Type::getInt64Ty(C),
+    call_descriptors.size());
+  call_counters = new GlobalVariable(M, countersTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(countersTy),
+    "call_counters");
+}
+
+void Instrument::instrument_indirect_calls(Module &M, std::set<Function*> &skip){
+  LLVMContext &C = M.getContext();
+  Type *i64 = Type::getInt64Ty(C);
+  Type *i8ptr = Type::getInt8PtrTy(C);
+
+  std::vector<Instruction*> sites;
+  std::vector<Constant*> descriptors;
+  for (Instruction *I : indirect_calls){
+    if (skip.find(I->getFunction()) != skip.end())
+      continue;
+    sites.push_back(I);
+    descriptors.push_back(alloc_site(M, I, "indirect"));
+  }
+
+  if (sites.empty())
+    return;
+
+  // The targets are profiled like any other value
+  GlobalVariable *profiles = alloc_value_profiles(M, sites.size(),
+    "indirect_call_profiles");
+  Function *f = get_profile_value(M);
+
+  for (unsigned i=0; i<sites.size(); i++){
+    CallSite CS(sites[i]);
+    IRBuilder<> Builder(sites[i]);
+
+    Value *args[] = {
+      ConstantExpr::getPointerCast(counter_slot(profiles, i), i8ptr),
+      Builder.CreatePtrToInt(CS.getCalledValue(), i64)
+    };
+    Builder.CreateCall(f, args);
+  }
+
+  register_table(M, "register_indirect_calls", descriptors, profiles);
+}
+
+void Instrument::collect_strides(Module &M, Function &F){
+  LLVMContext &C = M.getContext();
+  const DataLayout &DL = M.getDataLayout();
+  LoopInfo &LI = analyses->LI;
+  ScalarEvolution &SE = analyses->SE;
+
+  Type *i32 = Type::getInt32Ty(C);
+  Type *i64 = Type::getInt64Ty(C);
+
+  for (auto &BB : F){
+    Loop *L = LI.getLoopFor(&BB);
+    if (!L)
+      continue;
+
+    for (auto &I : BB){
+      Value *ptr = nullptr;
+      Type *ty = nullptr;
+      const char *kind = nullptr;
+
+      if (LoadInst *load = dyn_cast<LoadInst>(&I)){
+        ptr = load->getPointerOperand();
+        ty = load->getType();
+        kind = "load";
+      }
+      else if (StoreInst *store = dyn_cast<StoreInst>(&I)){
+        ptr = store->getPointerOperand();
+        ty = store->getValueOperand()->getType();
+        kind = "store";
+      }
+
+      if (!ptr || ptr->getType()->getPointerAddressSpace() != 0)
+        continue;
+
+      // An affine address in the innermost loop has a known stride
+      int64_t stride = 0;
+      bool known = false;
+      if (SE.isSCEVable(ptr->getType())){
+        const SCEV *S = SE.getSCEV(ptr);
+        if (const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(S)){
+          if (AR->getLoop() == L && AR->isAffine()){
+            if (const SCEVConstant *step =
+                  dyn_cast<SCEVConstant>(AR->getStepRecurrence(SE))){
+              stride = step->getAPInt().getSExtValue();
+              known = true;
+            }
+          }
+        }
+      }
+
+      // Layout of StrideSite in Collect/collect.h
+      Constant *site = alloc_site(M, &I, kind);
+      StructType *siteTy = StructType::get(site->getType(), i32, i32, i64,
+        nullptr);
+      stride_descriptors.push_back(ConstantStruct::get(siteTy, site,
+        ConstantInt::get(i32, DL.getTypeStoreSize(ty)),
+        ConstantInt::get(i32, known),
+        ConstantInt::get(i64, stride),
+        nullptr));
+      stride_sites.push_back(known ? nullptr : &I);
+    }
+  }
+}
+
+void Instrument::instrument_strides(Module &M){
+  LLVMContext &C = M.getContext();
+  Type *i8ptr = Type::getInt8PtrTy(C);
+  Type *i64 = Type::getInt64Ty(C);
+  const DataLayout &DL = M.getDataLayout();
+
+  if (stride_sites.empty())
+    return;
+
+  // Layout of StrideProfile in Collect/collect.h
+  StructType *profileTy = StructType::get(i64, i64, i64, i64, i64, i64,
+    nullptr);
+  ArrayType *profilesTy = ArrayType::get(profileTy, stride_sites.size());
+  GlobalVariable *profiles = new GlobalVariable(M, profilesTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(profilesTy),
+    "stride_profiles");
+
+  Constant *const_function = M.getOrInsertFunction("profile_stride",
+    Type::getVoidTy(C), i8ptr, i8ptr, i64, nullptr);
+  Function *f = cast<Function>(const_function);
+
+  for (unsigned i=0; i<stride_sites.size(); i++){
+    Instruction *I = stride_sites[i];
+
+    // Classified statically
+    if (!I)
+      continue;
+
+    Value *ptr;
+    Type *ty;
+    if (LoadInst *load = dyn_cast<LoadInst>(I)){
+      ptr = load->getPointerOperand();
+      ty = load->getType();
+    }
+    else {
+      StoreInst *store = cast<StoreInst>(I);
+      ptr = store->getPointerOperand();
+      ty = store->getValueOperand()->getType();
+    }
+
+    IRBuilder<> Builder(I);
+    Value *args[] = {
+      ConstantExpr::getPointerCast(counter_slot(profiles, i), i8ptr),
+      Builder.CreatePointerCast(ptr, i8ptr),
+      ConstantInt::get(i64, DL.getTypeStoreSize(ty))
+    };
+    Builder.CreateCall(f, args);
+  }
+
+  register_table(M, "register_strides", stride_descriptors, profiles);
+}
+
+void Instrument::collect_loops(Module &M, Function &F){
+  LoopInfo &LI = analyses->LI;
+
+  std::vector<Loop*> worklist(LI.begin(), LI.end());
+  while (!worklist.empty()){
+    Loop *L = worklist.back();
+    worklist.pop_back();
+    worklist.insert(worklist.end(), L->begin(), L->end());
+
+    BasicBlock *header = L->getHeader();
+    if (!L->getLoopPreheader() || !L->hasDedicatedExits() ||
+        header->getFirstInsertionPt() == header->end())
+      continue;
+
+    SmallVector<BasicBlock*, 4> exits;
+    L->getUniqueExitBlocks(exits);
+
+    bool placeable = true;
+    for (BasicBlock *exit : exits)
+      placeable &= exit->getFirstInsertionPt() != exit->end();
+    if (!placeable)
+      continue;
+
+    Instruction *located = header->getTerminator();
+    for (auto &I : *header){
+      if (I.getDebugLoc()){
+        located = &I;
+        break;
+      }
+    }
+
+    ProfiledLoop loop;
+    loop.preheader = L->getLoopPreheader();
+    loop.header = header;
+    loop.exits.assign(exits.begin(), exits.end());
+    loops.push_back(loop);
+    loop_descriptors.push_back(alloc_site(M, located,
+      "depth=" + std::to_string(L->getLoopDepth())));
+  }
+}
+
+void Instrument::instrument_loops(Module &M){
+  LLVMContext &C = M.getContext();
+  Type *i8ptr = Type::getInt8PtrTy(C);
+  Type *i64 = Type::getInt64Ty(C);
+
+  if (loops.empty())
+    return;
+
+  // Layout of LoopProfile in Collect/collect.h
+  StructType *profileTy = StructType::get(i64, i64, i64,
+    ArrayType::get(i64, TRIP_BUCKETS), nullptr);
+  ArrayType *profilesTy = ArrayType::get(profileTy, loops.size());
+  GlobalVariable *profiles = new GlobalVariable(M, profilesTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(profilesTy),
+    "loop_profiles");
+
+  Constant *const_function = M.getOrInsertFunction("profile_trips",
+    Type::getVoidTy(C), i8ptr, i64, nullptr);
+  Function *f = cast<Function>(const_function);
+
+  for (unsigned i=0; i<loops.size(); i++){
+    ProfiledLoop &loop = loops[i];
+    Function *F = loop.header->getParent();
+
+    // In the entry block, so that mem2reg promotes it after optimization
+    IRBuilder<> Builder(&*F->getEntryBlock().getFirstInsertionPt());
+    Value *trips = Builder.CreateAlloca(i64, nullptr, "trips");
+
+    Builder.SetInsertPoint(loop.preheader->getTerminator());
+    Builder.CreateStore(ConstantInt::get(i64, 0), trips);
+
+    Builder.SetInsertPoint(&*loop.header->getFirstInsertionPt());
+    Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(trips),
+      ConstantInt::get(i64, 1)), trips);
+
+    Constant *profile = ConstantExpr::getPointerCast(
+      counter_slot(profiles, i), i8ptr);
+    for (BasicBlock *exit : loop.exits){
+      Builder.SetInsertPoint(&*exit->getFirstInsertionPt());
+      Value *args[] = {profile, Builder.CreateLoad(trips)};
+      Builder.CreateCall(f, args);
+    }
+  }
+
+  register_table(M, "register_loops", loop_descriptors, profiles);
+}
+
+void Instrument::instrument_cycles(Module &M){
+  LLVMContext &C = M.getContext();
+  Type *i8ptr = Type::getInt8PtrTy(C);
+  Type *i64 = Type::getInt64Ty(C);
+
+  if (instrumented.empty())
+    return;
+
+  // Layout of FunctionCycles in Collect/collect.h
+  StructType *recordTy = StructType::get(i64, i64, i64, nullptr);
+  ArrayType *recordsTy = ArrayType::get(recordTy, instrumented.size());
+  GlobalVariable *records = new GlobalVariable(M, recordsTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(recordsTy),
+    "function_cycles");
+
+  Constant *const_enter = M.getOrInsertFunction("cycles_enter",
+    Type::getVoidTy(C), i8ptr, i64, nullptr);
+  Constant *const_exit = M.getOrInsertFunction("cycles_exit",
+    Type::getVoidTy(C), i8ptr, i64, nullptr);
+  Function *enter = cast<Function>(const_enter);
+  Function *exit = cast<Function>(const_exit);
+  Function *counter = Intrinsic::getDeclaration(&M,
+    Intrinsic::readcyclecounter);
+
+  std::vector<Constant*> descriptors;
+  for (unsigned i=0; i<instrumented.size(); i++){
+    Function *F = instrumented[i];
+    Constant *record = ConstantExpr::getPointerCast(counter_slot(records, i),
+      i8ptr);
+
+    Instruction *first = &*F->getEntryBlock().getFirstInsertionPt();
+    descriptors.push_back(alloc_site(M, first, "function"));
+
+    std::vector<Instruction*> exits;
+    for (auto &BB : *F){
+      Instruction *T = BB.getTerminator();
+      if (!isa<ReturnInst>(T) && !isa<ResumeInst>(T))
+        continue;
+
+      // Nothing may come between a musttail call and its return
+      Instruction *prev = T->getPrevNode();
+      if (CallInst *ci = dyn_cast_or_null<CallInst>(prev))
+        if (ci->isMustTailCall())
+          T = ci;
+      exits.push_back(T);
+    }
+
+    // The cycle counter is read at the probe, not inside the runtime
+    IRBuilder<> Builder(first);
+    Value *args[] = {record, Builder.CreateCall(counter)};
+    Builder.CreateCall(enter, args);
+
+    for (Instruction *T : exits){
+      Builder.SetInsertPoint(T);
+      Value *args[] = {record, Builder.CreateCall(counter)};
+      Builder.CreateCall(exit, args);
+    }
+  }
+
+  register_table(M, "register_cycles", descriptors, records);
+}
+
+void Instrument::instrument_ilp(Module &M){
+  LLVMContext &C = M.getContext();
+  Type *i8ptr = Type::getInt8PtrTy(C);
+  Type *i64 = Type::getInt64Ty(C);
+
+  if (instrumented.empty())
+    return;
+
+  // Layout of FunctionILP in Collect/collect.h
+  StructType *recordTy = StructType::get(i64, i64, i64, nullptr);
+  ArrayType *recordsTy = ArrayType::get(recordTy, instrumented.size());
+  GlobalVariable *records = new GlobalVariable(M, recordsTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(recordsTy),
+    "function_ilp");
+
+  Constant *const_enter = M.getOrInsertFunction("ilp_enter", i64, nullptr);
+  Constant *const_exit = M.getOrInsertFunction("ilp_exit",
+    Type::getVoidTy(C), i8ptr, i64, i64, nullptr);
+  Constant *const_load = M.getOrInsertFunction("ilp_load", i64, i8ptr, i64,
+    nullptr);
+  Constant *const_store = M.getOrInsertFunction("ilp_store",
+    Type::getVoidTy(C), i8ptr, i64, i64, nullptr);
+  Function *enter = cast<Function>(const_enter);
+  Function *exit = cast<Function>(const_exit);
+  Function *load_time = cast<Function>(const_load);
+  Function *store_time = cast<Function>(const_store);
+
+  Constant *zero = ConstantInt::get(i64, 0);
+  auto max = [](IRBuilder<> &Builder, Value *a, Value *b) -> Value* {
+    if (a == b)
+      return a;
+    return Builder.CreateSelect(Builder.CreateICmpUGT(a, b), a, b);
+  };
+
+  std::vector<Constant*> descriptors;
+  for (unsigned i=0; i<instrumented.size(); i++){
+    Function *F = instrumented[i];
+    const TargetTransformInfo &TTI =
+      getAnalysis<TargetTransformInfoWrapperPass>().getTTI(*F);
+
+    Instruction *first = &*F->getEntryBlock().getFirstInsertionPt();
+    descriptors.push_back(alloc_site(M, first, "function"));
+
+    // The ready times are relative to the entry of the invocation `id`
+    IRBuilder<> Builder(first);
+    Value *id = Builder.CreateCall(enter, std::vector<Value*>());
+    Value *critical = Builder.CreateAlloca(i64, nullptr, "critical");
+    Value *work = Builder.CreateAlloca(i64, nullptr, "work");
+    Builder.CreateStore(zero, critical);
+    Builder.CreateStore(zero, work);
+
+    Constant *record = ConstantExpr::getPointerCast(counter_slot(records, i),
+      i8ptr);
+    auto leave = [&](Instruction *I, Value *block_time, unsigned executed){
+      Builder.SetInsertPoint(I);
+      Value *args[] = {
+        record,
+        Builder.CreateAdd(Builder.CreateLoad(work),
+          ConstantInt::get(i64, executed)),
+        max(Builder, Builder.CreateLoad(critical), block_time)
+      };
+      Builder.CreateCall(exit, args);
+    };
+
+    std::map<Value*, Value*> ready;
+    std::vector<PHINode*> phis;
+    auto time_of = [&](Value *V) -> Value* {
+      auto it = ready.find(V);
+      return it == ready.end() ? zero : it->second;
+    };
+
+    // Operands are defined before their uses, except for the PHIs
+    ReversePostOrderTraversal<Function*> RPOT(F);
+    for (BasicBlock *BB : RPOT){
+      std::vector<Instruction*> original;
+      for (auto &I : *BB)
+        if (ilp_instructions.count(&I))
+          original.push_back(&I);
+
+      // Nothing may come between a musttail call and its return
+      Instruction *end = BB->getTerminator();
+      if (CallInst *ci = dyn_cast_or_null<CallInst>(end->getPrevNode()))
+        if (ci->isMustTailCall())
+          end = ci;
+
+      Value *block_time = zero;
+      unsigned executed = 0;
+      for (Instruction *I : original){
+        if (isa<DbgInfoIntrinsic>(I))
+          continue;
+
+        if (PHINode *phi = dyn_cast<PHINode>(I)){
+          PHINode *time = PHINode::Create(i64, phi->getNumIncomingValues(),
+            "ready", &BB->front());
+          ready[phi] = time;
+          phis.push_back(phi);
+          continue;
+        }
+
+        // exit does not return, its invocation ends before the dump
+        if (CallInst *ci = dyn_cast<CallInst>(I)){
+          Function *callee = ci->getCalledFunction();
+          if (callee && callee->getName() == "exit")
+            leave(before_dump(ci), block_time, executed);
+        }
+
+        ++executed;
+        if (I->isEHPad())
+          continue;
+
+        // The latency of a cost is the closest TTI has
+        int cost = TTI.getUserCost(I);
+        // The time of a return is read before the dump of main
+        bool leaves = isa<ReturnInst>(I) || isa<ResumeInst>(I);
+        Builder.SetInsertPoint(leaves ? before_dump(I) : I);
+        Value *time = zero;
+        for (Value *op : I->operands())
+          time = max(Builder, time, time_of(op));
+
+        LoadInst *load = dyn_cast<LoadInst>(I);
+        StoreInst *store = dyn_cast<StoreInst>(I);
+        if (load && load->getPointerAddressSpace() == 0){
+          Value *args[] = {
+            Builder.CreatePointerCast(load->getPointerOperand(), i8ptr), id
+          };
+          time = max(Builder, time, Builder.CreateCall(load_time, args));
+        }
+
+        if (cost > 0)
+          time = Builder.CreateAdd(time, ConstantInt::get(i64, cost));
+
+        if (store && store->getPointerAddressSpace() == 0){
+          Value *args[] = {
+            Builder.CreatePointerCast(store->getPointerOperand(), i8ptr),
+            id, time
+          };
+          Builder.CreateCall(store_time, args);
+        }
+
+        ready[I] = time;
+        block_time = max(Builder, block_time, time);
+      }
+
+      if (isa<ReturnInst>(BB->getTerminator()) ||
+          isa<ResumeInst>(BB->getTerminator())){
+        leave(before_dump(BB->getTerminator()), block_time, executed);
+        continue;
+      }
+
+      Builder.SetInsertPoint(end);
+      Builder.CreateStore(max(Builder, Builder.CreateLoad(critical),
+        block_time), critical);
+      Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(work),
+        ConstantInt::get(i64, executed)), work);
+    }
+
+    // A value that comes from a block that never runs is ready at 0
+    for (PHINode *phi : phis){
+      PHINode *time = cast<PHINode>(ready[phi]);
+      for (unsigned k=0; k<phi->getNumIncomingValues(); k++)
+        time->addIncoming(time_of(phi->getIncomingValue(k)),
+          phi->getIncomingBlock(k));
+    }
+  }
+
+  register_table(M, "register_ilp", descriptors, records);
+}
+
+/*
+  Reciprocal throughput of I, from the same queries that the cost model
+  analysis (-cost-model -analyze) uses
+*/
+static unsigned throughput_cost(const TargetTransformInfo &TTI, Instruction *I){
+  int cost;
+
+  if (isa<BinaryOperator>(I)){
+    cost = TTI.getArithmeticInstrCost(I->getOpcode(), I->getType());
+  }
+  else if (isa<ICmpInst>(I) || isa<FCmpInst>(I)){
+    cost = TTI.getCmpSelInstrCost(I->getOpcode(),
+      I->getOperand(0)->getType());
+  }
+  else if (SelectInst *si = dyn_cast<SelectInst>(I)){
+    cost = TTI.getCmpSelInstrCost(I->getOpcode(), si->getType(),
+      si->getCondition()->getType());
+  }
+  else if (LoadInst *load = dyn_cast<LoadInst>(I)){
+    cost = TTI.getMemoryOpCost(I->getOpcode(), load->getType(),
+      load->getAlignment(), load->getPointerAddressSpace());
+  }
+  else if (StoreInst *store = dyn_cast<StoreInst>(I)){
+    cost = TTI.getMemoryOpCost(I->getOpcode(),
+      store->getValueOperand()->getType(), store->getAlignment(),
+      store->getPointerAddressSpace());
+  }
+  else if (CallInst *ci = dyn_cast<CallInst>(I)){
+    std::vector<Type*> types;
+    for (Value *arg : ci->arg_operands())
+      types.push_back(arg->getType());
+    if (Function *callee = ci->getCalledFunction())
+      cost = TTI.getCallInstrCost(callee, ci->getType(), types);
+    else
+      cost = TTI.getUserCost(I);
+  }
+  else {
+    cost = TTI.getUserCost(I);
+  }
+
+  return cost > 0 ? cost : 0;
+}
+
+void Instrument::collect_costs(Module &M){
+  LLVMContext &C = M.getContext();
+  Type *i8ptr = Type::getInt8PtrTy(C);
+
+  std::vector<Constant*> descriptors;
+
+  for (auto &F : M){
+    if (F.isDeclaration())
+      continue;
+
+    const TargetTransformInfo &TTI =
+      getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+
+    std::map<std::string, unsigned> slots;
+    for (auto &BB : F){
+      for (auto &I : BB){
+        if (!is_counted(&I))
+          continue;
+
+        std::string opcodeName = counter_name(&I);
+        if (slots.find(opcodeName) == slots.end()){
+          slots[opcodeName] = descriptors.size();
+          // Layout of CostSite in Collect/collect.h
+          descriptors.push_back(ConstantStruct::get(
+            StructType::get(i8ptr, i8ptr, nullptr),
+            alloc_global_string(M, F.getName()),
+            alloc_global_string(M, opcodeName),
+            nullptr));
+        }
+
+        // TTI has no latency query, the size-and-latency cost is the closest
+        int latency = TTI.getUserCost(&I);
+        costs[&I] = std::make_tuple(slots[opcodeName],
+          throughput_cost(TTI, &I), latency > 0 ? latency : 0);
+      }
+    }
+  }
+
+  if (descriptors.empty())
+    return;
+
+  ArrayType *countersTy = ArrayType::get(Type::getInt64Ty(C),
+    3 * descriptors.size());
+  cost_counters = new GlobalVariable(M, countersTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(countersTy),
+    "cost_counters");
+
+  cost_descriptors = descriptors;
+}
+
+void Instrument::collect_memory(Module &M){
+  LLVMContext &C = M.getContext();
+  const DataLayout &DL = M.getDataLayout();
+
+  std::vector<Constant*> descriptors;
+
+  for (auto &F : M){
+    if (F.isDeclaration())
+      continue;
+
+    unsigned slot = descriptors.size();
+    memory_functions[&F] = slot;
+    descriptors.push_back(alloc_global_string(M, F.getName()));
+
+    for (auto &BB : F){
+      for (auto &I : BB){
+        if (LoadInst *load = dyn_cast<LoadInst>(&I))
+          memory_ops[&I] = std::make_pair(slot,
+            (unsigned)DL.getTypeStoreSize(load->getType()));
+        else if (StoreInst *store = dyn_cast<StoreInst>(&I))
+          memory_ops[&I] = std::make_pair(slot,
+            (unsigned)DL.getTypeStoreSize(store->getValueOperand()->getType()));
+      }
+    }
+  }
+
+  if (descriptors.empty())
+    return;
+
+  ArrayType *countersTy = ArrayType::get(Type::getInt64Ty(C),
+    4 * descriptors.size());
+  memory_counters = new GlobalVariable(M, countersTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(countersTy),
+    "memory_counters");
+
+  memory_descriptors = descriptors;
+}
+
+/*
+  Kind of allocation done by a call, and the arguments with its size (or
+  the pointer, for free and delete)
+*/
+static const char* allocation_kind(CallSite CS){
+  Function *callee = dyn_cast<Function>(
+    CS.getCalledValue()->stripPointerCasts());
+  if (!callee || CS.arg_size() == 0)
+    return nullptr;
+
+  StringRef name = callee->getName();
+  if (name == "malloc")
+    return "malloc";
+  if (name == "calloc" && CS.arg_size() == 2)
+    return "calloc";
+  if (name == "realloc" && CS.arg_size() == 2)
+    return "realloc";
+  if (name == "free")
+    return "free";
+  // operator new / new[] and delete / delete[], in all their overloads
+  if (name.startswith("_Znw") || name.startswith("_Zna"))
+    return "new";
+  if (name.startswith("_Zdl") || name.startswith("_Zda"))
+    return "delete";
+  return nullptr;
+}
+
+void Instrument::instrument_allocations(Module &M){
+  LLVMContext &C = M.getContext();
+  const DataLayout &DL = M.getDataLayout();
+  Type *i8ptr = Type::getInt8PtrTy(C);
+  Type *i64 = Type::getInt64Ty(C);
+
+  std::vector<std::pair<Instruction*, const char*> > sites;
+  std::vector<Constant*> descriptors;
+  std::vector<Instruction*> transfers;
+
+  for (Function *F : instrumented){
+    for (auto &BB : *F){
+      for (auto &I : BB){
+        const char *kind = nullptr;
+        if (isa<AllocaInst>(&I))
+          kind = "alloca";
+        else if (isa<MemIntrinsic>(&I))
+          transfers.push_back(&I);
+        else if (CallSite CS = CallSite(&I))
+          kind = allocation_kind(CS);
+
+        if (!kind)
+          continue;
+        sites.push_back(std::make_pair(&I, kind));
+        descriptors.push_back(alloc_site(M, &I, kind));
+      }
+    }
+  }
+
+  // memcpy, memmove and memset move a number of bytes known at run time
+  for (Instruction *I : transfers){
+    MemIntrinsic *mi = cast<MemIntrinsic>(I);
+    unsigned slot = memory_functions[I->getFunction()];
+
+    IRBuilder<> Builder(I);
+    Value *length = Builder.CreateZExtOrTrunc(mi->getLength(), i64);
+    if (isa<MemTransferInst>(mi))
+      insert_counter_inc(I, counter_slot(memory_counters, 4*slot + 1), length);
+    insert_counter_inc(I, counter_slot(memory_counters, 4*slot + 3), length);
+  }
+
+  if (sites.empty())
+    return;
+
+  // Layout of AllocProfile in Collect/collect.h
+  StructType *profileTy = StructType::get(i64, i64,
+    ArrayType::get(i64, ALLOC_BUCKETS), nullptr);
+  ArrayType *profilesTy = ArrayType::get(profileTy, sites.size());
+  GlobalVariable *profiles = new GlobalVariable(M, profilesTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(profilesTy),
+    "alloc_profiles");
+
+  Constant *const_alloc = M.getOrInsertFunction("profile_alloc",
+    Type::getVoidTy(C), i8ptr, i64, nullptr);
+  Constant *const_free = M.getOrInsertFunction("profile_free",
+    Type::getVoidTy(C), i8ptr, i8ptr, nullptr);
+  Function *profile_alloc = cast<Function>(const_alloc);
+  Function *profile_free = cast<Function>(const_free);
+
+  for (unsigned i=0; i<sites.size(); i++){
+    Instruction *I = sites[i].first;
+    StringRef kind = sites[i].second;
+    Constant *profile = ConstantExpr::getPointerCast(counter_slot(profiles, i),
+      i8ptr);
+
+    IRBuilder<> Builder(I);
+
+    // The memory is released by the call, so it is measured before it
+    if (kind == "free" || kind == "delete"){
+      Value *args[] = {profile,
+        Builder.CreatePointerCast(CallSite(I).getArgument(0), i8ptr)};
+      Builder.CreateCall(profile_free, args);
+      continue;
+    }
+
+    Value *size;
+    if (AllocaInst *AI = dyn_cast<AllocaInst>(I)){
+      size = Builder.CreateMul(
+        ConstantInt::get(i64, DL.getTypeAllocSize(AI->getAllocatedType())),
+        Builder.CreateZExtOrTrunc(AI->getArraySize(), i64));
+    }
+    else {
+      CallSite CS(I);
+      if (kind == "calloc")
+        size = Builder.CreateMul(
+          Builder.CreateZExtOrTrunc(CS.getArgument(0), i64),
+          Builder.CreateZExtOrTrunc(CS.getArgument(1), i64));
+      else if (kind == "realloc")
+        size = Builder.CreateZExtOrTrunc(CS.getArgument(1), i64);
+      else
+        size = Builder.CreateZExtOrTrunc(CS.getArgument(0), i64);
+    }
+
+    Value *args[] = {profile, size};
+    Builder.CreateCall(profile_alloc, args);
+  }
+
+  register_table(M, "register_allocs", descriptors, profiles);
+}
+
+/*
+  Name of the AddressSanitizer or UndefinedBehaviorSanitizer check called
+  by I (a report, an outlined load or store check or a UBSan handler),
+  without the leading underscores and the abort variants, or an empty
+  string. The other runtime functions, such as the __asan_memcpy that
+  replaces the program's own memcpy or the fake stack of ASan, are user
+  work.
+*/
+static std::string sanitizer_kind(Instruction *I){
+  CallSite CS(I);
+  if (!CS)
+    return "";
+
+  Function *callee = dyn_cast<Function>(
+    CS.getCalledValue()->stripPointerCasts());
+  if (!callee)
+    return "";
+
+  StringRef name = callee->getName();
+  if (!name.startswith("__asan_report_") && !name.startswith("__asan_load") &&
+      !name.startswith("__asan_store") && !name.startswith("__ubsan_handle_"))
+    return "";
+
+  name = name.drop_front(2);
+  for (StringRef suffix : {"_noabort", "_abort", "_minimal"})
+    if (name.endswith(suffix))
+      name = name.drop_back(suffix.size());
+  return name.str();
+}
+
+void Instrument::collect_sanitizers(Module &M){
+  LLVMContext &C = M.getContext();
+  Type *i8ptr = Type::getInt8PtrTy(C);
+
+  std::map<std::pair<std::string, std::string>, unsigned> slots;
+  std::vector<Constant*> descriptors;
+
+  auto slot_of = [&](const std::string &kind, const std::string &opcodeName){
+    auto key = std::make_pair(kind, opcodeName);
+    auto it = slots.find(key);
+    if (it != slots.end())
+      return it->second;
+
+    unsigned slot = descriptors.size();
+    slots[key] = slot;
+    // Layout of SanitizerSite in Collect/collect.h
+    descriptors.push_back(ConstantStruct::get(
+      StructType::get(i8ptr, i8ptr, nullptr),
+      alloc_global_string(M, kind),
+      alloc_global_string(M, opcodeName),
+      nullptr));
+    return slot;
+  };
+
+  for (auto &F : M){
+    if (F.isDeclaration())
+      continue;
+
+    std::map<Instruction*, std::string> kinds;
+    std::map<BasicBlock*, std::string> reports, checks;
+
+    for (auto &BB : F){
+      for (auto &I : BB){
+        std::string kind = sanitizer_kind(&I);
+        if (!kind.empty() && !reports.count(&BB))
+          reports[&BB] = kind;
+      }
+    }
+
+    // Whether every instruction of BB but `except` is sanitizer code
+    auto only_checks = [&](BasicBlock &BB, Instruction *except){
+      for (auto &I : BB)
+        if (&I != except && !isa<DbgInfoIntrinsic>(&I) && !kinds.count(&I))
+          return false;
+      return true;
+    };
+
+    /*
+      The sanitizer code of a block is its calls to the runtime, its
+      branch to a check block, and the instructions without side effects
+      used only by those (the shadow address, load and compare of ASan).
+      A check block has only sanitizer code, so the branches to it are
+      checks as well, and the process is repeated until nothing changes.
+    */
+    bool changed = true;
+    while (changed){
+      changed = false;
+
+      for (auto &BB : F){
+        Instruction *T = BB.getTerminator();
+
+        for (auto it = BB.rbegin(); it != BB.rend(); ++it){
+          Instruction *I = &*it;
+          if (kinds.count(I))
+            continue;
+
+          std::string kind = sanitizer_kind(I);
+          if (kind.empty() && I == T){
+            BranchInst *br = dyn_cast<BranchInst>(T);
+            if (br && br->isConditional()){
+              for (unsigned i=0; i<2 && kind.empty(); i++){
+                auto check = checks.find(br->getSuccessor(i));
+                if (check != checks.end())
+                  kind = check->second;
+              }
+            }
+            else if (reports.count(&BB) &&
+                     (isa<UnreachableInst>(T) || br) && only_checks(BB, T)){
+              kind = reports[&BB];
+            }
+          }
+          else if (kind.empty() && !isa<PHINode>(I) &&
+                   !I->mayHaveSideEffects() && !I->use_empty()){
+            for (User *U : I->users()){
+              auto user = kinds.find(cast<Instruction>(U));
+              if (user == kinds.end()){
+                kind.clear();
+                break;
+              }
+              if (kind.empty())
+                kind = user->second;
+            }
+          }
+
+          if (!kind.empty()){
+            kinds[I] = kind;
+            changed = true;
+          }
+        }
+
+        if (!checks.count(&BB) && kinds.count(T) && only_checks(BB, nullptr)){
+          checks[&BB] = kinds[T];
+          changed = true;
+        }
+      }
+    }
+
+    // What is left of the code emitted by clang for -fsanitize=undefined
+    for (auto &BB : F)
+      for (auto &I : BB)
+        if (!kinds.count(&I) && I.getMetadata("nosanitize"))
+          kinds[&I] = "nosanitize";
+
+    auto kind_of = [&](Instruction *I){
+      auto it = kinds.find(I);
+      return it == kinds.end() ? std::string("user") : it->second;
+    };
+
+    for (auto &BB : F){
+      for (auto &I : BB)
+        if (is_counted(&I))
+          sanitizer_slots[std::make_pair(&I, false)] =
+            slot_of(kind_of(&I), counter_name(&I));
+
+      // The branch counted on merge blocks
+      Instruction *T = BB.getTerminator();
+      if (getNumPredecessors(&BB) >= 2)
+        sanitizer_slots[std::make_pair(T, true)] = slot_of(kind_of(T), "br");
+    }
+  }
+
+  if (descriptors.empty())
+    return;
+
+  ArrayType *countersTy = ArrayType::get(Type::getInt64Ty(C),
+    descriptors.size());
+  sanitizer_counters = new GlobalVariable(M, countersTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(countersTy),
+    "sanitizer_counters");
+
+  sanitizer_descriptors = descriptors;
+}
+
+void Instrument::collect_coverage(Module &M, Function &F){
+  LLVMContext &C = M.getContext();
+  Type *i32 = Type::getInt32Ty(C);
+
+  // Control-equivalent blocks run together, only the leader stores
+  std::map<BasicBlock*, BasicBlock*> leaders;
+  equivalence_classes(F, leaders);
+
+  /*
+    Unless a call in the class may not return (exit, longjmp, a throw):
+    then the blocks after it may not run, and each block stores its own
+    byte
+  */
+  std::set<BasicBlock*> stops;
+  for (auto &BB : F)
+    for (auto &I : BB)
+      if (&I != BB.getTerminator() &&
+          !isGuaranteedToTransferExecutionToSuccessor(&I))
+        stops.insert(leaders[&BB]);
+
+  for (auto &BB : F)
+    if (stops.count(leaders[&BB]))
+      leaders[&BB] = &BB;
+
+  std::map<BasicBlock*, unsigned> slots;
+  unsigned slot = coverage_descriptors.size();
+  for (auto &BB : F)
+    slots[&BB] = slot++;
+
+  for (auto &BB : F){
+    Instruction *located = BB.getTerminator();
+    for (auto &I : BB){
+      if (I.getDebugLoc()){
+        located = &I;
+        break;
+      }
+    }
+
+    // Layout of CoverageSite in Collect/collect.h
+    Constant *site = alloc_site(M, located, "block");
+    StructType *siteTy = StructType::get(site->getType(), i32, nullptr);
+    coverage_descriptors.push_back(ConstantStruct::get(siteTy, site,
+      ConstantInt::get(i32, slots[leaders[&BB]]), nullptr));
+
+    // catchswitch blocks have no place for a store
+    if (leaders[&BB] == &BB && BB.getFirstInsertionPt() != BB.end())
+      coverage_points.push_back(std::make_pair(&*BB.getFirstInsertionPt(),
+        slots[&BB]));
+  }
+}
+
+void Instrument::instrument_coverage(Module &M){
+  LLVMContext &C = M.getContext();
+  Type *i8 = Type::getInt8Ty(C);
+
+  if (coverage_descriptors.empty())
+    return;
+
+  ArrayType *bitmapTy = ArrayType::get(i8, coverage_descriptors.size());
+  GlobalVariable *bitmap = new GlobalVariable(M, bitmapTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(bitmapTy),
+    "coverage_bitmap");
+
+  Constant *one = ConstantInt::get(i8, 1);
+  for (auto &point : coverage_points){
+    IRBuilder<> Builder(point.first);
+    Constant *indices[] = {ConstantInt::get(Type::getInt64Ty(C), 0),
+      ConstantInt::get(Type::getInt64Ty(C), point.second)};
+    Builder.CreateStore(one, ConstantExpr::getInBoundsGetElementPtr(bitmapTy,
+      bitmap, indices));
+  }
+
+  register_table(M, "register_coverage", coverage_descriptors, bitmap);
+}
+
+/*
+  An edge of the Ball-Larus DAG of a function, between two blocks or from
+  a block to the virtual exit. Each back edge is replaced by two dummy
+  edges, from the entry to the loop header (Restart) and from the latch
+  to the exit (Back), and `pair` is the Restart edge of a Back one.
+*/
+struct PathEdge {
+  enum Kind { Edge, Exit, Back, Restart };
+
+  unsigned from, to;
+  unsigned successor;
+  Kind kind;
+  unsigned pair;
+  uint64_t value;
+};
+
+static const char *path_edge_kinds[] = {"edge", "exit", "back", "restart"};
+
+/*
+  Bounds the number of paths of a function, so that the path id plus the
+  offset of the function in the counters never overflows
+*/
+static const uint64_t MAX_PATHS = 1ULL << 62;
+
+/*
+  Numbers the acyclic paths of F as in Ball and Larus, "Efficient Path
+  Profiling" (1996): the blocks are visited in a reverse topological
+  order of the DAG, and each edge gets as value the number of paths from
+  its source that go through the edges before it. The sum of the values
+  of the edges of a path is its id, from 0 to the number of paths minus
+  one, which is returned. `blocks` holds the blocks reachable from the
+  entry, the index of the virtual exit is blocks.size(). Returns 0 for
+  the functions that are not supported: those with terminators other
+  than br, switch, ret and unreachable, or with more than MAX_PATHS paths.
+*/
+static uint64_t number_paths(Function &F, std::vector<BasicBlock*> &blocks,
+    std::vector<PathEdge> &edges){
+
+  std::map<BasicBlock*, unsigned> index;
+  std::set<std::pair<BasicBlock*, unsigned> > back;
+  std::vector<BasicBlock*> postorder;
+
+  // An edge to a block that is on the DFS stack is a back edge
+  BasicBlock *entry = &F.getEntryBlock();
+  std::vector<std::pair<BasicBlock*, unsigned> > stack;
+  std::set<BasicBlock*> onstack;
+  index[entry] = 0;
+  blocks.push_back(entry);
+  stack.push_back(std::make_pair(entry, 0u));
+  onstack.insert(entry);
+
+  while (!stack.empty()){
+    BasicBlock *BB = stack.back().first;
+    auto *T = BB->getTerminator();
+    if (!isa<BranchInst>(T) && !isa<SwitchInst>(T) && !isa<ReturnInst>(T) &&
+        !isa<UnreachableInst>(T))
+      return 0;
+
+    if (stack.back().second < T->getNumSuccessors()){
+      unsigned i = stack.back().second++;
+      BasicBlock *succ = T->getSuccessor(i);
+      if (onstack.count(succ))
+        back.insert(std::make_pair(BB, i));
+      else if (index.insert(std::make_pair(succ, blocks.size())).second){
+        blocks.push_back(succ);
+        stack.push_back(std::make_pair(succ, 0u));
+        onstack.insert(succ);
+      }
+      continue;
+    }
+
+    postorder.push_back(BB);
+    onstack.erase(BB);
+    stack.pop_back();
+  }
+
+  unsigned exit = blocks.size();
+  std::vector<std::vector<unsigned> > out(blocks.size());
+  auto add_edge = [&](unsigned from, unsigned to, unsigned successor,
+                      PathEdge::Kind kind){
+    PathEdge e = {from, to, successor, kind, 0, 0};
+    out[from].push_back(edges.size());
+    edges.push_back(e);
+  };
+
+  for (unsigned u=0; u<blocks.size(); u++){
+    auto *T = blocks[u]->getTerminator();
+    if (T->getNumSuccessors() == 0)
+      add_edge(u, exit, 0, PathEdge::Exit);
+
+    for (unsigned i=0; i<T->getNumSuccessors(); i++){
+      unsigned v = index[T->getSuccessor(i)];
+      if (back.count(std::make_pair(blocks[u], i))){
+        add_edge(0, v, i, PathEdge::Restart);
+        add_edge(u, exit, i, PathEdge::Back);
+        edges.back().pair = edges.size() - 2;
+      }
+      else {
+        add_edge(u, v, i, PathEdge::Edge);
+      }
+    }
+  }
+
+  std::vector<uint64_t> paths(blocks.size() + 1, 0);
+  paths[exit] = 1;
+  for (BasicBlock *BB : postorder){
+    unsigned u = index[BB];
+    for (unsigned e : out[u]){
+      edges[e].value = paths[u];
+      paths[u] += paths[edges[e].to];
+      if (paths[u] > MAX_PATHS)
+        return 0;
+    }
+  }
+
+  return paths[0];
+}
+
+void Instrument::instrument_paths(Module &M){
+  LLVMContext &C = M.getContext();
+  Type *i8ptr = Type::getInt8PtrTy(C);
+  Type *i64 = Type::getInt64Ty(C);
+
+  struct PathFunction {
+    Function *F;
+    std::vector<BasicBlock*> blocks;
+    std::vector<PathEdge> edges;
+    uint64_t paths;
+    uint64_t offset;
+    bool hashed;
+  };
+
+  std::vector<PathFunction> functions;
+  std::vector<Constant*> descriptors;
+  uint64_t size = 0;
+
+  for (Function *F : instrumented){
+    PathFunction pf;
+    pf.F = F;
+    pf.paths = number_paths(*F, pf.blocks, pf.edges);
+    if (pf.paths == 0)
+      continue;
+
+    // Hash tables have the number of lost paths and (path + 1, count) pairs
+    pf.hashed = pf.paths > PathSlots;
+    pf.offset = size;
+    size += pf.hashed ? 1 + 2 * PATH_HASH_SIZE : pf.paths;
+
+    /*
+      The graph is written by the runtime next to the counts, for
+      Tools/decode_paths, one `block <index> <name> <line>` and
+      `edge <from> <to> <value> <kind>` per line
+    */
+    std::string graph;
+    raw_string_ostream out(graph);
+    for (unsigned i=0; i<pf.blocks.size(); i++){
+      BasicBlock *BB = pf.blocks[i];
+      out << "block " << i << " ";
+      if (BB->hasName())
+        out << BB->getName();
+      else
+        out << "bb" << i;
+      out << " " << block_line(BB) << "\n";
+    }
+    for (auto &e : pf.edges)
+      out << "edge " << e.from << " " << e.to << " " << e.value << " "
+          << path_edge_kinds[e.kind] << "\n";
+    out.flush();
+
+    // Layout of PathSite in Collect/collect.h
+    Constant *site = alloc_site(M, &*F->getEntryBlock().getFirstInsertionPt(),
+      pf.hashed ? "hash" : "array");
+    StructType *siteTy = StructType::get(site->getType(), i64, i64, i8ptr,
+      nullptr);
+    descriptors.push_back(ConstantStruct::get(siteTy, site,
+      ConstantInt::get(i64, pf.paths), ConstantInt::get(i64, pf.offset),
+      alloc_global_string(M, graph), nullptr));
+
+    functions.push_back(pf);
+  }
+
+  if (functions.empty())
+    return;
+
+  ArrayType *countersTy = ArrayType::get(i64, size);
+  GlobalVariable *counters = new GlobalVariable(M, countersTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(countersTy),
+    "path_counters");
+
+  Constant *const_function = M.getOrInsertFunction("profile_path",
+    Type::getVoidTy(C), i8ptr, i64, nullptr);
+  Function *profile_path = cast<Function>(const_function);
+
+  for (auto &pf : functions){
+    IRBuilder<> Builder(&*pf.F->getEntryBlock().getFirstInsertionPt());
+    Value *path = Builder.CreateAlloca(i64, nullptr, "path");
+    Builder.CreateStore(Builder.getInt64(0), path);
+
+    auto record = [&](Instruction *I, uint64_t value){
+      IRBuilder<> Builder(I);
+      Value *id = Builder.CreateAdd(Builder.CreateLoad(path),
+        Builder.getInt64(value));
+      if (pf.hashed){
+        Value *args[] = {
+          ConstantExpr::getPointerCast(counter_slot(counters, pf.offset), i8ptr),
+          id
+        };
+        Builder.CreateCall(profile_path, args);
+      }
+      else {
+        Value *indices[] = {Builder.getInt64(0),
+          Builder.CreateAdd(id, Builder.getInt64(pf.offset))};
+        insert_counter_inc(I, Builder.CreateInBoundsGEP(counters, indices), 1);
+      }
+    };
+
+    // The code of an edge goes in its source or its target when it is
+    // their only edge, otherwise in a new block
+    auto edge_point = [&](BasicBlock *BB, unsigned i) -> Instruction* {
+      auto *T = BB->getTerminator();
+      BasicBlock *dest = T->getSuccessor(i);
+      if (T->getNumSuccessors() == 1)
+        return T;
+      if (dest->getSinglePredecessor())
+        return &*dest->getFirstInsertionPt();
+      return split_edge(BB, i, "path.edge")->getTerminator();
+    };
+
+    for (auto &e : pf.edges){
+      BasicBlock *BB = pf.blocks[e.from];
+
+      if (e.kind == PathEdge::Edge && e.value != 0){
+        IRBuilder<> Builder(edge_point(BB, e.successor));
+        Builder.CreateStore(Builder.CreateAdd(Builder.CreateLoad(path),
+          Builder.getInt64(e.value)), path);
+      }
+      else if (e.kind == PathEdge::Back){
+        Instruction *I = edge_point(BB, e.successor);
+        record(I, e.value);
+        new StoreInst(ConstantInt::get(i64, pf.edges[e.pair].value), path, I);
+      }
+      else if (e.kind == PathEdge::Exit && isa<ReturnInst>(BB->getTerminator())){
+        // Before the dump of main and a musttail call
+        record(before_dump(BB->getTerminator()), e.value);
+      }
+    }
+  }
+
+  register_table(M, "register_paths", descriptors, counters);
+}
+
+unsigned Instrument::block_line(BasicBlock *BB){
+  for (auto &I : *BB)
+    if (DILocation *loc = I.getDebugLoc().get())
+      if (loc->getLine())
+        return loc->getLine();
+  return 0;
+}
+
+void Instrument::instrument_branches(Module &M){
+  LLVMContext &C = M.getContext();
+  Type *i8ptr = Type::getInt8PtrTy(C);
+  Type *i32 = Type::getInt32Ty(C);
+  Type *i64 = Type::getInt64Ty(C);
+
+  // Layout of BranchSite in Collect/collect.h
+  StructType *siteTy = StructType::get(i8ptr, i8ptr, i32, i8ptr, i32, i32,
+    nullptr);
+
+  std::vector<Constant*> descriptors;
+  std::vector<std::pair<Instruction*, unsigned> > entries, branches;
+
+  auto add_site = [&](Instruction *I, StringRef kind, unsigned target,
+                      unsigned function_line){
+    Constant *site = alloc_site(M, I, kind);
+    descriptors.push_back(ConstantStruct::get(siteTy,
+      site->getAggregateElement(0u), site->getAggregateElement(1u),
+      site->getAggregateElement(2u), site->getAggregateElement(3u),
+      ConstantInt::get(i32, target), ConstantInt::get(i32, function_line),
+      nullptr));
+  };
+
+  /*
+    Every function gets one slot for its entry, each conditional branch
+    one slot per direction and each switch one slot per successor:
+    slot 0 is the default destination and slot i is the i-th case.
+  */
+  for (Function *F : instrumented){
+    unsigned function_line = 0;
+    if (DISubprogram *SP = F->getSubprogram())
+      function_line = SP->getLine();
+
+    Instruction *entry = &*F->getEntryBlock().getFirstInsertionPt();
+    entries.push_back(std::make_pair(entry, descriptors.size()));
+    add_site(entry, "entry", function_line, function_line);
+
+    for (auto &BB : *F){
+      Instruction *T = BB.getTerminator();
+
+      if (BranchInst *br = dyn_cast<BranchInst>(T)){
+        if (br->isUnconditional())
+          continue;
+        branches.push_back(std::make_pair(T, descriptors.size()));
+        add_site(T, "taken", block_line(br->getSuccessor(0)), function_line);
+        add_site(T, "not-taken", block_line(br->getSuccessor(1)), function_line);
+      }
+      else if (SwitchInst *si = dyn_cast<SwitchInst>(T)){
+        std::map<unsigned, std::string> kinds;
+        kinds[0] = "default";
+        for (auto Case : si->cases())
+          kinds[Case.getSuccessorIndex()] = "case=" +
+            std::to_string(Case.getCaseValue()->getSExtValue());
+
+        branches.push_back(std::make_pair(T, descriptors.size()));
+        for (unsigned i=0; i<si->getNumSuccessors(); i++)
+          add_site(T, kinds[i], block_line(si->getSuccessor(i)), function_line);
+      }
+    }
+  }
+
+  if (descriptors.empty())
+    return;
+
+  ArrayType *countersTy = ArrayType::get(i64, descriptors.size());
+  GlobalVariable *counters = new GlobalVariable(M, countersTy, false,
+    GlobalValue::InternalLinkage, ConstantAggregateZero::get(countersTy),
+    "branch_counters");
+
+  for (auto &entry : entries)
+    insert_counter_inc(entry.first, counter_slot(counters, entry.second), 1);
+
+  for (auto &branch : branches){
+    unsigned slot = branch.second;
+
+    // Conditional branches pick the slot of the direction taken
+    if (BranchInst *br = dyn_cast<BranchInst>(branch.first)){
+      IRBuilder<> Builder(br);
+      Value *idx = Builder.CreateSelect(br->getCondition(),
+        Builder.getInt64(slot), Builder.getInt64(slot + 1));
+      Value *indices[] = {Builder.getInt64(0), idx};
+      insert_counter_inc(br, Builder.CreateInBoundsGEP(counters, indices), 1);
+      continue;
+    }
+
+    // Several cases of a switch may go to the same block, so each
+    // successor gets its own edge block with the counter
+    SwitchInst *si = cast<SwitchInst>(branch.first);
+    BasicBlock *BB = si->getParent();
+    for (unsigned i=0; i<si->getNumSuccessors(); i++){
+      BasicBlock *edge = split_edge(BB, i, "switch.edge");
+      insert_counter_inc(edge->getTerminator(), counter_slot(counters, slot + i), 1);
+    }
+  }
+
+  register_table(M, "register_branches", descriptors, counters);
+}
+
+BasicBlock* Instrument::split_edge(BasicBlock *BB, unsigned i,
+    const Twine &name){
+
+  auto *T = BB->getTerminator();
+  BasicBlock *dest = T->getSuccessor(i);
+  BasicBlock *edge = BasicBlock::Create(BB->getContext(), name,
+    BB->getParent(), dest);
+  BranchInst::Create(dest, edge);
+
+  // PHIs have one entry per edge, and we move one of them to the new block
+  for (auto &I : *dest){
+    PHINode *phi = dyn_cast<PHINode>(&I);
+    if (!phi)
+      break;
+    phi->setIncomingBlock(phi->getBasicBlockIndex(BB), edge);
+  }
+
+  T->setSuccessor(i, edge);
+  return edge;
+}
+
+int Instrument::getNumPredecessors(BasicBlock *BB){
+  int cnt = 0;
+  
+  for (BasicBlock *Pred : predecessors(BB))
+    cnt++;
+
+  return cnt;
+}
+
+
+bool Instrument::runOnModule(Module &M) {
+
+  // An LTO link of modules compiled with the pass would count twice
+  if (is_instrumented(M)){
+    errs() << "Instrument: " << M.getModuleIdentifier()
+           << " is already instrumented, skipping it\n";
+    return false;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  uint64_t size = 0;
+  if (TimeReport)
+    for (auto &F : M)
+      for (auto &BB : F)
+        size += BB.size();
+
+  opcode_counters.assign(Instruction::OtherOpsEnd, nullptr);
+  ctor = nullptr;
+  strings.clear();
+  line_slots.clear();
+  line_descriptors.clear();
+  line_counters = nullptr;
+  flush = nullptr;
+  dense_slots.clear();
+  instrumented.clear();
+  call_slots.clear();
+  call_descriptors.clear();
+  indirect_calls.clear();
+  call_counters = nullptr;
+  stride_sites.clear();
+  costs.clear();
+  cost_descriptors.clear();
+  cost_counters = nullptr;
+  memory_ops.clear();
+  memory_functions.clear();
+  memory_descriptors.clear();
+  memory_counters = nullptr;
+  loops.clear();
+  loop_descriptors.clear();
+  sanitizer_slots.clear();
+  sanitizer_descriptors.clear();
+  sanitizer_counters = nullptr;
+  ilp_instructions.clear();
+  coverage_points.clear();
+  coverage_descriptors.clear();
+  stride_descriptors.clear();
+
+  dense = whole_program || WholeProgram;
+  if (dense && !M.getFunction("main")){
+    errs() << "Instrument: " << M.getModuleIdentifier()
+           << " has no main, it is not a whole program\n";
+    dense = false;
+  }
+
+  std::set<Function*> live;
+  if (dense)
+    live_functions(M, live);
+
+  // Their counters are updated along with the opcode counters, which
+  // coverage does not insert
+  if (Coverage && (CountLines || ProfileCalls || ProfileCost ||
+                   ProfileMemory || ProfileSanitizers))
+    report_fatal_error("Instrument: -instrument-coverage cannot be combined "
+                       "with -instrument-lines, -instrument-calls, "
+                       "-instrument-cost, -instrument-memory or "
+                       "-instrument-sanitizers");
+
+  if (CountLines)
+    collect_lines(M);
+
+  if (ProfileCalls)
+    collect_calls(M);
+
+  if (ProfileCost)
+    collect_costs(M);
+
+  if (ProfileMemory)
+    collect_memory(M);
+
+  if (ProfileSanitizers)
+    collect_sanitizers(M);
+
+  select_functions(M);
+
+  std::set<Function*> skipped;
+  for (auto &F : M){
+    if (F.isDeclaration())
+      continue;
+
+    // The counters are dumped even when main and the callers of exit are
+    // not instrumented
+    if ((dense && live.find(&F) == live.end()) || !should_instrument(F)){
+      insert_dump_calls(M, F);
+      skipped.insert(&F);
+      continue;
+    }
+    FunctionAnalyses FA(F, getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(),
+      getAnalysis<AssumptionCacheTracker>().getAssumptionCache(F));
+    analyses = &FA;
+
+    // Before the counters, whose loads and stores are not program accesses
+    if (ProfileStrides)
+      collect_strides(M, F);
+    if (ProfileILP)
+      for (auto &BB : F)
+        for (auto &I : BB)
+          ilp_instructions.insert(&I);
+    if (ProfileLoops)
+      collect_loops(M, F);
+    if (Coverage)
+      collect_coverage(M, F);
+    else
+      instrument_function(M, F);
+    insert_dump_calls(M, F);
+    instrumented.push_back(&F);
+    analyses = nullptr;
+  }
+
+  if (Coverage)
+    instrument_coverage(M);
+
+  if (ProfileCalls){
+    register_table(M, "register_calls", call_descriptors, call_counters);
+    instrument_indirect_calls(M, skipped);
+  }
+
+  if (ProfileCost)
+    register_table(M, "register_costs", cost_descriptors, cost_counters);
+
+  if (ProfileMemory){
+    instrument_allocations(M);
+    register_table(M, "register_memory", memory_descriptors, memory_counters);
+  }
+
+  if (ProfileSanitizers)
+    register_table(M, "register_sanitizers", sanitizer_descriptors,
+      sanitizer_counters);
+
+  if (ProfileValues)
+    instrument_values(M);
+
+  if (ProfileStrides)
+    instrument_strides(M);
+
+  if (ProfileLoops)
+    instrument_loops(M);
+
+  if (ProfileCycles)
+    instrument_cycles(M);
+
+  if (ProfileILP)
+    instrument_ilp(M);
+
+  // These change the CFG, keep them after the modes that use LoopInfo
+  if (ProfilePaths)
+    instrument_paths(M);
+
+  if (ProfileBranches)
+    instrument_branches(M);
+
+  if (CountLines)
+    register_lines(M);
+
+  if (dense)
+    densify(M);
+
+  if (TimeReport){
+    std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+    errs() << "Instrument: " << M.getModuleIdentifier() << ": " << size
+           << " instructions in " << elapsed.count() << "s, "
+           << (size ? elapsed.count() * 100000 / size : 0.0)
+           << "s per 100k instructions\n";
+  }
+
+  return true;
+}
+
+char Instrument::ID = 0;
+static RegisterPass<Instrument> X("Instrument",
+    "Instrument");
+
+/*
+  When the plugin is loaded by an LTO link, the pass runs once on the
+  merged module, in whole-program mode.
+*/
+static void registerLTO(const PassManagerBuilder &,
+                        legacy::PassManagerBase &PM) {
+  PM.add(new Instrument(true));
+}
+static RegisterStandardPasses Z(PassManagerBuilder::EP_FullLinkTimeOptimizationLast,
+    registerLTO);
\ No newline at end of file
@@ -2,12 +2,46 @@
 
 using namespace llvm;
 
+// Counter update emitted with -instrument-intrinsics, see InstrumentLower.h
+#define INCREMENT "basilisk_increment"
+
+// Number of values kept per site, must match VALUE_TOPK in Collect/collect.h
+#define VALUE_TOPK 4
+
+// log2 buckets of the allocation sizes, must match Collect/collect.h
+#define ALLOC_BUCKETS 64
+
+// log2 buckets of the loop trip counts, must match Collect/collect.h
+#define TRIP_BUCKETS 64
+
+// Entries of the hash table of a path-profiled function, must match Collect/collect.h
+#define PATH_HASH_SIZE 1024
+
+/*
+  Amount to add to each counter, in the order the counters were first seen
+*/
+typedef MapVector<Value*, uint64_t> Histogram;
+
+/*
+  A loop of -instrument-loops, kept by its blocks: the LoopInfo of a
+  function does not survive the analysis of the next one
+*/
+struct ProfiledLoop {
+  BasicBlock *preheader;
+  BasicBlock *header;
+  std::vector<BasicBlock*> exits;
+};
+
+// Defined in Instrument.cpp
+struct FunctionAnalyses;
+
 class Instrument : public ModulePass {
   public: 
   // Pass identifier, for LLVM's RTTI support:
   static char ID;
 
   bool runOnModule(Module&);
+  void getAnalysisUsage(AnalysisUsage &AU) const;
 
   /*
     Debugging method
@@ -22,6 +56,11 @@ class Instrument : public ModulePass {
     ` @0 = private unnamed_addr constant [6 x i8] c"store\00" `
   */
   Value* alloc_string(Instruction *I);
+
+  /*
+    The `<opcode>_inc` counter of I, or the `br_inc` one for the branches
+    of merge blocks. Resolved once per module and cached by opcode.
+  */
   Value* alloc_counter(Module &M, Instruction *I, bool branch);
   
   /*
@@ -37,10 +76,317 @@ class Instrument : public ModulePass {
     `count_instruction` is defined in the file Collect/collect.c
   */
   void insert_call(Module &M, Instruction *inst);
-  void insert_inc(Module &M, Instruction *inst, bool branch);
+  void insert_counter_inc(Instruction *inst, Value *ptr, uint64_t amount);
+  void insert_counter_inc(Instruction *inst, Value *ptr, Value *amount);
+  Function* get_increment(Module &M);
+
+  /*
+    Pointer to the i64 at position `slot` of a counter array
+  */
+  Constant* counter_slot(GlobalVariable *array, unsigned slot);
   int getNumPredecessors(BasicBlock *BB);
 
+  /*
+    True for the instructions that get an `<opcode>_inc` counter.
+  */
+  static bool is_counted(Instruction *I);
+
+  /*
+    Name of the counter bumped by a counted instruction, without the
+    `_inc` suffix. It is the opcode name, except for invoke, which is
+    counted as a call.
+  */
+  static std::string counter_name(Instruction *I);
+
+  /*
+    Creates a private constant with the contents of `str` and returns an i8*
+    to its first character. Strings are shared inside a module.
+  */
+  Constant* alloc_global_string(Module &M, StringRef str);
+
+  /*
+    Adds a call to @name(args) to the module constructor. The constructor is
+    created on demand and is used to register per-module tables with the
+    runtime in Collect/collect.c
+  */
+  void insert_ctor_call(Module &M, const std::string &name, ArrayRef<Value*> args);
+
+  /*
+    True if the pass already ran on `M`, or on one of the modules an LTO
+    link merged into it: there is a constructor, a call to a register_*
+    function of Collect/collect.c or an opcode counter.
+  */
+  static bool is_instrumented(Module &M);
+
+  /*
+    Counts every instrumented opcode per source line, using the DILocation of
+    the instruction. Instructions without debug info are not counted here.
+    Unlike count.csv, br counts every br, switch and indirectbr, so that it
+    matches the BR of PinLib/CountLines. The runtime writes the result to
+    lines.csv
+  */
+  void collect_lines(Module &M);
+  void register_lines(Module &M);
+
+  /*
+    Maps each block to the leader of its control-equivalence class: the
+    block of the class that dominates all the others. All blocks of a class
+    run the same number of times, so their counters are updated together,
+    at the beginning of the leader.
+  */
+  void equivalence_classes(Function &F, std::map<BasicBlock*, BasicBlock*> &leaders);
+
+  // DT, PDT, LoopInfo and SCEV of the function being instrumented
+  FunctionAnalyses *analyses = nullptr;
+
+  /*
+    Records that `inst` must bump its opcode counter (and its line counter)
+    in the histogram of its class. With -instrument-share-counters=false
+    the increment is inserted right before `inst`, one per instruction.
+  */
+  void count_inc(Module &M, Histogram &hist, Instruction *inst, bool branch);
+
+  /*
+    Adds every counter of the histogram at the beginning of BB
+  */
+  void insert_histogram(BasicBlock *BB, Histogram &hist);
+  void instrument_function(Module &M, Function &F);
+
+  // Dumps the counters before the returns of main and the calls to exit
+  void insert_dump_calls(Module &M, Function &F);
+
+  /*
+    The point before the dump calls (and a musttail call) that come
+    before I, where the profiles must be complete
+  */
+  Instruction* before_dump(Instruction *I);
+
+  /*
+    Selective instrumentation. A function is instrumented when its name
+    matches one of the -instrument-only regexes (or there are none), it
+    matches none of the -instrument-skip ones and, with
+    -instrument-hot-profile, it is one of the -instrument-hot-functions
+    heaviest functions of that profile.
+  */
+  void select_functions(Module &M);
+  bool should_instrument(Function &F);
+
+  std::vector<Regex> only;
+  std::vector<Regex> skip;
+  std::set<std::string> hot;
+
+  /*
+    Whole-program mode (-instrument-whole-program, or LTO). Every counter
+    is a slot of a single internal array, `basilisk_counters`, instead of
+    an external `<opcode>_inc` global. The opcode slots are moved into
+    the runtime globals by `basilisk_flush`, which is called before each
+    dump. Functions that cannot be reached from main are not instrumented.
+  */
+  Value* alloc_dense_counter(Module &M, const std::string &name);
+  Function* get_flush(Module &M);
+  void live_functions(Module &M, std::set<Function*> &live);
+  void densify(Module &M);
+
+  /*
+    Describes an instrumented instruction to the runtime, with the layout of
+    `Site` in Collect/collect.h: function, file, line and kind of the site.
+  */
+  Constant* alloc_site(Module &M, Instruction *I, StringRef kind);
+
+  /*
+    Emits the array of `sites` and registers it, together with the per-site
+    `data`, by calling @name(sites, data, n) from the module constructor.
+  */
+  void register_table(Module &M, const std::string &name,
+    std::vector<Constant*> &sites, GlobalVariable *data);
+
+  /*
+    Value profiling (-instrument-values): each divisor of udiv/sdiv/urem/srem,
+    shift amount and select condition that is not a constant is passed to
+    @profile_value, which keeps its VALUE_TOPK most frequent values
+    (space-saving, see ValueProfile in Collect/collect.h).
+  */
+  void instrument_values(Module &M);
+  GlobalVariable* alloc_value_profiles(Module &M, unsigned n, const std::string &name);
+  Function* get_profile_value(Module &M);
+
+  /*
+    Call profiling (-instrument-calls): every direct call site has a
+    counter, updated with the counters of its block, and is described by
+    its caller and callee. Indirect calls pass their target to
+    @profile_value; the runtime resolves the addresses to symbols.
+  */
+  void collect_calls(Module &M);
+  void instrument_indirect_calls(Module &M, std::set<Function*> &skip);
+
+  std::map<Instruction*, unsigned> call_slots;
+  std::vector<Constant*> call_descriptors;
+  std::vector<Instruction*> indirect_calls;
+  GlobalVariable *call_counters = nullptr;
+
+  /*
+    Stride profiling (-instrument-strides): the loads and stores inside
+    loops. When SCEV proves that the address is affine in the innermost
+    loop, the stride is written in the table and the site is not
+    instrumented; otherwise @profile_stride classifies the distance between
+    consecutive addresses as unit, constant or irregular at run time.
+    `stride_sites` is null for the sites classified statically.
+  */
+  void collect_strides(Module &M, Function &F);
+  void instrument_strides(Module &M);
+
+  std::vector<Instruction*> stride_sites;
+  std::vector<Constant*> stride_descriptors;
+
+  /*
+    Loop profiling (-instrument-loops): the trip count of each loop with a
+    preheader and dedicated exits (as left by -loop-simplify) is kept in a
+    stack slot, cleared in the preheader and bumped in the header. Each
+    exit passes it to @profile_trips, which keeps a log2 histogram of the
+    trip counts per loop. A return or the unwind edge of an invoke leaves
+    through an exit block as well; only the unwinding through a plain
+    call, longjmp and exit() leave a loop unrecorded.
+  */
+  void collect_loops(Module &M, Function &F);
+  void instrument_loops(Module &M);
+
+  std::vector<ProfiledLoop> loops;
+  std::vector<Constant*> loop_descriptors;
+
+  /*
+    Cost profiling (-instrument-cost): every counted instruction also adds
+    its TargetTransformInfo throughput and latency costs to the counters
+    of its (function, opcode) pair, through the shared block updates. The
+    costs are those of the target given to opt (-mtriple, -mcpu).
+  */
+  void collect_costs(Module &M);
+
+  // Instruction -> (slot, throughput, latency)
+  std::map<Instruction*, std::tuple<unsigned, unsigned, unsigned> > costs;
+  std::vector<Constant*> cost_descriptors;
+  GlobalVariable *cost_counters = nullptr;
+
+  /*
+    Memory profiling (-instrument-memory). Each function has four counters,
+    loads, bytes loaded, stores and bytes stored, updated with the block
+    counters using the DataLayout size of each access; memcpy, memmove and
+    memset add their length. Allocas and calls to malloc, calloc, realloc,
+    free, new and delete call @profile_alloc or @profile_free with the
+    profile of their site, which keeps a log2 histogram of the sizes.
+  */
+  void collect_memory(Module &M);
+  void instrument_allocations(Module &M);
+
+  // Load or store -> (function slot, bytes)
+  std::map<Instruction*, std::pair<unsigned, unsigned> > memory_ops;
+  std::map<Function*, unsigned> memory_functions;
+  std::vector<Constant*> memory_descriptors;
+  GlobalVariable *memory_counters = nullptr;
+
+  /*
+    Sanitizer attribution (-instrument-sanitizers), for modules that went
+    through the sanitizer passes: every counted instruction is either
+    user code or part of an ASan or UBSan check (the call to a report,
+    an outlined check or a UBSan handler, the branch to the block that
+    reports, and the values only used by those), or carries `nosanitize`
+    metadata. The terminator of a block is a check only when the whole
+    block is. Each
+    (kind, opcode) pair has a counter, updated with the block counters.
+  */
+  void collect_sanitizers(Module &M);
+
+  // (Instruction, counted as the branch of a merge block) -> slot
+  std::map<std::pair<Instruction*, bool>, unsigned> sanitizer_slots;
+  std::vector<Constant*> sanitizer_descriptors;
+  GlobalVariable *sanitizer_counters = nullptr;
+
+  /*
+    Coverage (-instrument-coverage), instead of the opcode counters. Every
+    block has a byte in `coverage_bitmap`; the leader of each class of
+    control-equivalent blocks stores 1 in its byte when it runs, and the
+    descriptor of every block points to the byte of its leader. A class
+    with a call that may not return gets a byte per block. The modes
+    whose counters ride on the opcode counters (lines, calls, cost,
+    memory, sanitizers) cannot be combined with it.
+  */
+  void collect_coverage(Module &M, Function &F);
+  void instrument_coverage(Module &M);
+
+  std::vector<std::pair<Instruction*, unsigned> > coverage_points;
+  std::vector<Constant*> coverage_descriptors;
+
+  /*
+    Cycle profiling (-instrument-cycles): every instrumented function calls
+    @cycles_enter on entry and @cycles_exit before its returns and resumes,
+    with its record in `function_cycles` and the value of
+    llvm.readcyclecounter. The runtime keeps a shadow stack per thread.
+  */
+  void instrument_cycles(Module &M);
+
+  /*
+    Critical-path profiling (-instrument-ilp): every value of the original
+    code gets a shadow i64, its ready time, which is the latest ready time
+    of its operands plus its latency (the TTI cost). Loads also wait for
+    the time of the last store to their word, kept by the runtime in a
+    shadow memory with @ilp_load and @ilp_store. Each invocation gets an
+    id from @ilp_enter, and the times of other invocations (callers,
+    callees, earlier calls) count as 0, so calls are opaque. The returns
+    pass the instructions executed and the longest ready time to
+    @ilp_exit, before the dump of main; their ratio is the available ILP.
+    A call to exit ends its own invocation the same way, but the
+    invocations of its callers are still open and are dropped.
+  */
+  void instrument_ilp(Module &M);
+
+  // The instructions of the functions before any instrumentation
+  std::set<Instruction*> ilp_instructions;
+
+  /*
+    Branch profiling (-instrument-branches): counts the entries of each
+    function, both directions of each conditional branch and every
+    successor of each switch. Tools/export_profile turns branches.csv into
+    a profile that clang can use for PGO.
+  */
+  void instrument_branches(Module &M);
+
+  /*
+    Path profiling (-instrument-paths): the acyclic paths of each function
+    are numbered as in Ball-Larus, and the edges with a non-zero value add
+    it to the id of the current path, kept in a stack slot. Returns and
+    back edges count the path; back edges then start the id of the paths
+    from the loop header. Functions with more paths than
+    -instrument-path-slots count them in a hash table of PATH_HASH_SIZE
+    entries, through @profile_path. Paths that end in unreachable (exit,
+    abort) are not counted, and functions with exception handling or
+    indirectbr are not profiled.
+  */
+  void instrument_paths(Module &M);
+
+  // Inserts a block on the edge from BB to its successor i
+  BasicBlock* split_edge(BasicBlock *BB, unsigned i, const Twine &name);
+
+  // Line of the first instruction of BB with debug info, or 0
+  unsigned block_line(BasicBlock *BB);
+
+  // Functions that got counters, the other modes only look at these
+  std::vector<Function*> instrumented;
+
+  bool whole_program = false;
+  bool dense = false;
+  Function *flush = nullptr;
+  MapVector<std::string, Value*, std::map<std::string, unsigned> > dense_slots;
+
+  // Indexed by opcode, reset for each module
+  std::vector<Value*> opcode_counters;
+
+  Function *ctor = nullptr;
+  std::map<std::string, Constant*> strings;
+  std::map<Instruction*, unsigned> line_slots;
+  std::vector<Constant*> line_descriptors;
+  GlobalVariable *line_counters = nullptr;
+
   Instrument() : ModulePass(ID) {}
+  Instrument(bool whole_program) : ModulePass(ID), whole_program(whole_program) {}
   ~Instrument() { }
 
 };
\ No newline at end of file
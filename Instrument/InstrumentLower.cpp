@@ -0,0 +1,195 @@
+#include "llvm/Pass.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Support/Regex.h"
+
+#include <map>
+#include <vector>
+
+#include "Instrument.h"
+#include "InstrumentLower.h"
+
+#define DEBUG_TYPE "InstrumentLower"
+
+void InstrumentLower::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.addRequired<DominatorTreeWrapperPass>();
+  AU.addRequired<LoopInfoWrapperPass>();
+  AU.addRequired<ScalarEvolutionWrapperPass>();
+  AU.setPreservesCFG();
+}
+
+bool InstrumentLower::is_increment(Instruction *I){
+  if (CallInst *ci = dyn_cast<CallInst>(I))
+    if (Function *f = ci->getCalledFunction())
+      return f->getName() == INCREMENT;
+  return false;
+}
+
+bool InstrumentLower::merge(BasicBlock &BB){
+  std::map<Value*, CallInst*> last;
+  std::vector<CallInst*> merged;
+
+  // The sum is placed on the later call, where both amounts are available
+  for (auto &I : BB){
+    if (!is_increment(&I)){
+      // A call may exit or read the counters, the earlier ones must be done
+      if ((isa<CallInst>(&I) || isa<InvokeInst>(&I)) &&
+          !isa<DbgInfoIntrinsic>(&I))
+        last.clear();
+      continue;
+    }
+
+    CallInst *ci = cast<CallInst>(&I);
+    Value *ptr = ci->getArgOperand(0);
+
+    if (last.find(ptr) != last.end()){
+      CallInst *prev = last[ptr];
+      IRBuilder<> Builder(ci);
+      ci->setArgOperand(1, Builder.CreateAdd(prev->getArgOperand(1),
+        ci->getArgOperand(1)));
+      merged.push_back(prev);
+    }
+    last[ptr] = ci;
+  }
+
+  for (CallInst *ci : merged)
+    ci->eraseFromParent();
+
+  return !merged.empty();
+}
+
+bool InstrumentLower::hoist(Loop *L, LoopInfo &LI, DominatorTree &DT,
+    ScalarEvolution &SE){
+
+  BasicBlock *preheader = L->getLoopPreheader();
+  BasicBlock *latch = L->getLoopLatch();
+
+  // Blocks that dominate the latch run once per iteration only when the
+  // latch is the way out of the loop
+  if (!preheader || !latch || L->getExitingBlock() != latch)
+    return false;
+
+  // Nor when an iteration may stop halfway: exit, abort, longjmp, a throw
+  for (BasicBlock *BB : L->blocks())
+    for (auto &I : *BB)
+      if (!is_increment(&I) && !isGuaranteedToTransferExecutionToSuccessor(&I))
+        return false;
+
+  const SCEV *backedges = SE.getBackedgeTakenCount(L);
+  if (isa<SCEVCouldNotCompute>(backedges))
+    return false;
+
+  Type *i64 = Type::getInt64Ty(preheader->getContext());
+  const SCEV *trips = SE.getAddExpr(SE.getTruncateOrZeroExtend(backedges, i64),
+    SE.getConstant(i64, 1));
+
+  std::vector<CallInst*> candidates;
+  for (BasicBlock *BB : L->blocks()){
+    if (LI.getLoopFor(BB) != L || !DT.dominates(BB, latch))
+      continue;
+
+    for (auto &I : *BB){
+      if (!is_increment(&I))
+        continue;
+
+      CallInst *ci = cast<CallInst>(&I);
+      if (!L->isLoopInvariant(ci->getArgOperand(0)) ||
+          !SE.isLoopInvariant(SE.getSCEV(ci->getArgOperand(1)), L))
+        continue;
+
+      candidates.push_back(ci);
+    }
+  }
+
+  if (candidates.empty())
+    return false;
+
+  SCEVExpander Expander(SE, preheader->getModule()->getDataLayout(), "trips");
+  Instruction *insertPt = preheader->getTerminator();
+
+  for (CallInst *ci : candidates){
+    const SCEV *total = SE.getMulExpr(SE.getSCEV(ci->getArgOperand(1)), trips);
+    Value *amount = Expander.expandCodeFor(total, i64, insertPt);
+
+    Value *args[] = {ci->getArgOperand(0), amount};
+    CallInst::Create(ci->getCalledFunction(), args, "", insertPt);
+    ci->eraseFromParent();
+  }
+
+  merge(*preheader);
+  return true;
+}
+
+void InstrumentLower::hoist_loops(Loop *L, LoopInfo &LI, DominatorTree &DT,
+    ScalarEvolution &SE){
+
+  // Inner loops first, so that their increments can keep moving out
+  for (Loop *sub : *L)
+    hoist_loops(sub, LI, DT, SE);
+
+  hoist(L, LI, DT, SE);
+}
+
+void InstrumentLower::lower(CallInst *CI){
+  IRBuilder<> Builder(CI);
+  Value *ptr = CI->getArgOperand(0);
+
+  LoadInst *Load = Builder.CreateLoad(ptr);
+  Value *Inc = Builder.CreateAdd(CI->getArgOperand(1), Load);
+  Builder.CreateStore(Inc, ptr);
+
+  CI->eraseFromParent();
+}
+
+bool InstrumentLower::runOnFunction(Function &F){
+  if (!F.getParent()->getFunction(INCREMENT))
+    return false;
+
+  for (auto &BB : F)
+    merge(BB);
+
+  LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+  ScalarEvolution &SE = getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+
+  for (Loop *L : LI)
+    hoist_loops(L, LI, DT, SE);
+
+  std::vector<CallInst*> increments;
+  for (auto &BB : F)
+    for (auto &I : BB)
+      if (is_increment(&I))
+        increments.push_back(cast<CallInst>(&I));
+
+  for (CallInst *ci : increments)
+    lower(ci);
+
+  return true;
+}
+
+char InstrumentLower::ID = 0;
+static RegisterPass<InstrumentLower> L("InstrumentLower",
+    "Lower the counter increments emitted with -instrument-intrinsics");
+
+/*
+  When the plugin is loaded in a -O pipeline, lower the increments after
+  the loop optimizations and right before the vectorizer. At -O0 nothing
+  else runs, so they are lowered as they are.
+*/
+static void registerLower(const PassManagerBuilder &,
+                          legacy::PassManagerBase &PM) {
+  PM.add(new InstrumentLower());
+}
+static RegisterStandardPasses L1(PassManagerBuilder::EP_VectorizerStart,
+    registerLower);
+static RegisterStandardPasses L2(PassManagerBuilder::EP_EnabledOnOptLevel0,
+    registerLower);
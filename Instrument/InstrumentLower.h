@@ -0,0 +1,41 @@
+#pragma once
+
+using namespace llvm;
+
+/*
+  With -instrument-intrinsics the Instrument pass does not update the
+  counters directly. It emits calls to @basilisk_increment(i64* counter,
+  i64 amount) instead, which only touch their argument and never unwind,
+  so the optimizer keeps working around them. This pass runs late (right
+  before the vectorizer when it is loaded in a -O pipeline) and turns the
+  calls back into plain updates:
+
+  - increments of the same counter in a block are merged, unless a call
+    comes between them;
+  - increments in a block that runs exactly once per iteration of a loop
+    with a computable trip count are moved to the preheader, multiplied
+    by the trip count, leaving the loop body free of instrumentation.
+    Only loops whose every instruction transfers execution to the next
+    one qualify: a call that may exit, abort, longjmp or throw would stop
+    the loop before the iterations it was credited with;
+  - what is left becomes a load/add/store.
+*/
+class InstrumentLower : public FunctionPass {
+  public:
+  // Pass identifier, for LLVM's RTTI support:
+  static char ID;
+
+  bool runOnFunction(Function &F);
+  void getAnalysisUsage(AnalysisUsage &AU) const;
+
+  static bool is_increment(Instruction *I);
+
+  bool merge(BasicBlock &BB);
+  bool hoist(Loop *L, LoopInfo &LI, DominatorTree &DT, ScalarEvolution &SE);
+  void hoist_loops(Loop *L, LoopInfo &LI, DominatorTree &DT, ScalarEvolution &SE);
+  void lower(CallInst *CI);
+
+  InstrumentLower() : FunctionPass(ID) {}
+  ~InstrumentLower() { }
+
+};
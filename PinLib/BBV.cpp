@@ -0,0 +1,170 @@
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "pin.H"
+#include "instlib.H"
+#include "lib.H"
+#include "sampling.H"
+#include "writer.H"
+
+using namespace INSTLIB;
+
+/*
+  Writes the basic-block vector of every interval of -interval executed
+  instructions, for Tools/simpoint. The stream (bbv.bin) is
+
+    "BBV1" <interval size: u64>
+    for each interval: <instructions: u64> <n: u32> n * (<block: u32> <instructions: u64>)
+
+  where a block counts the instructions it executed in the interval, and
+  the last interval may be shorter. bbv.blocks.csv gives the address,
+  size and routine of each block.
+*/
+
+KNOB<string> KnobOutput(KNOB_MODE_WRITEONCE, "pintool", "o", "bbv.bin",
+    "Output file");
+
+struct Block {
+  UINT32 id;
+  UINT32 size;
+  UINT64 count;
+  ADDRINT address;
+  string routine;
+};
+
+static map<std::pair<ADDRINT, UINT32>, Block*> blocks;
+static vector<Block*> by_id;
+static vector<Block*> touched;
+static UINT64 interval_start = 0;
+
+// Guards `touched` and the end of an interval, the counts are atomic
+static PIN_LOCK touched_lock;
+
+BufferedWriter writer;
+
+ADDRINT count_block(Block *b, THREADID tid){
+  if (__sync_fetch_and_add(&b->count, b->size) == 0){
+    PIN_GetLock(&touched_lock, tid + 1);
+    touched.push_back(b);
+    PIN_ReleaseLock(&touched_lock);
+  }
+  return __sync_add_and_fetch(&executed, b->size) >= next_boundary;
+}
+
+VOID write_interval(){
+  UINT64 end = executed;
+  vector<std::pair<UINT32, UINT64> > counts;
+  for (size_t i=0; i<touched.size(); i++){
+    UINT64 count = __sync_lock_test_and_set(&touched[i]->count, 0);
+    if (count != 0)
+      counts.push_back(std::make_pair(touched[i]->id, count));
+  }
+  touched.clear();
+
+  writer.put<UINT64>(end - interval_start);
+  writer.put<UINT32>(counts.size());
+  for (size_t i=0; i<counts.size(); i++){
+    writer.put<UINT32>(counts[i].first);
+    writer.put<UINT64>(counts[i].second);
+  }
+
+  interval_start = end;
+  next_boundary = end + interval_size;
+}
+
+VOID end_interval(THREADID tid){
+  PIN_GetLock(&touched_lock, tid + 1);
+  // Another thread may have ended the interval already
+  if (executed >= next_boundary)
+    write_interval();
+  PIN_ReleaseLock(&touched_lock);
+}
+
+Block* get_block(BBL bbl, RTN rtn){
+  // Pin may build different blocks that start at the same address
+  std::pair<ADDRINT, UINT32> key(BBL_Address(bbl), BBL_NumIns(bbl));
+
+  map<std::pair<ADDRINT, UINT32>, Block*>::iterator it = blocks.find(key);
+  if (it != blocks.end())
+    return it->second;
+
+  Block *b = new Block;
+  b->id = by_id.size();
+  b->size = BBL_NumIns(bbl);
+  b->count = 0;
+  b->address = BBL_Address(bbl);
+  b->routine = RTN_Valid(rtn) ? RTN_Name(rtn) : "";
+  blocks[key] = b;
+  by_id.push_back(b);
+  return b;
+}
+
+VOID Trace(TRACE trace, VOID *a) {
+  RTN rtn = TRACE_Rtn(trace);
+
+  for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+    BBL_InsertIfCall(bbl, IPOINT_BEFORE, (AFUNPTR)count_block,
+        IARG_PTR, get_block(bbl, rtn), IARG_THREAD_ID, IARG_END);
+    BBL_InsertThenCall(bbl, IPOINT_BEFORE, (AFUNPTR)end_interval,
+        IARG_THREAD_ID, IARG_END);
+  }
+}
+
+VOID Fini(INT32 code, VOID *v) {
+  if (executed > interval_start)
+    write_interval();
+  writer.close();
+
+  std::ofstream out("bbv.blocks.csv");
+  out << "ID,ADDRESS,INSTRUCTIONS,ROUTINE\n";
+  for (size_t i=0; i<by_id.size(); i++)
+    out << by_id[i]->id << ",0x" << std::hex << by_id[i]->address << std::dec
+        << ',' << by_id[i]->size << ',' << by_id[i]->routine << '\n';
+  out.close();
+}
+
+/* ===================================================================== */
+/* Print Help Message                                                    */
+/* ===================================================================== */
+
+INT32 Usage() {
+  cerr << "Writes the basic-block vector of each interval of -interval "
+          "instructions, to choose simulation points with Tools/simpoint\n"
+          "\n";
+
+  return -1;
+}
+
+/* ===================================================================== */
+/* Main                                                                  */
+/* ===================================================================== */
+
+int main(int argc, char *argv[]) {
+  if (PIN_Init(argc, argv)) {
+    return Usage();
+  }
+
+  interval_size = KnobInterval.Value();
+  next_boundary = interval_size;
+  PIN_InitLock(&touched_lock);
+
+  if (!writer.open(KnobOutput.Value().c_str())){
+    cerr << "Cannot create file " << KnobOutput.Value() << "\n";
+    return 1;
+  }
+  writer.write("BBV1", 4);
+  writer.put<UINT64>(interval_size);
+
+  PIN_InitSymbols();
+  TRACE_AddInstrumentFunction(Trace, 0);
+
+  PIN_AddFiniFunction(Fini, NULL);
+
+  // Start the program, never returns
+  PIN_StartProgram();
+
+  return 0;
+}
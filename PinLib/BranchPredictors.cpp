@@ -0,0 +1,429 @@
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "pin.H"
+#include "instlib.H"
+#include "lib.H"
+#include "sampling.H"
+
+using namespace INSTLIB;
+
+/*
+  Simulates branch predictors on the executed branches. The outcome of
+  every conditional branch goes to a bimodal predictor, to gshare and to
+  a small TAGE (a bimodal base and tagged tables indexed with geometric
+  lengths of global history, from 4 to 64 bits), and the target of every
+  indirect branch or call goes to a BTB. Returns are left out, a return
+  stack predicts them. Each thread has its own predictors, as it would
+  have its own core.
+
+  bpred.csv has a row per branch, with the routine and the source line
+  (compile the program with -g) and the misprediction rate of each model,
+  from the branch with the most mispredictions under TAGE (conditional)
+  or the BTB (indirect): those are the branches worth turning into a
+  select or reorganizing. The TOTAL rows add up all the branches.
+*/
+
+ofstream out;
+FILTER filter;
+
+KNOB<UINT32> KnobBimodalBits(KNOB_MODE_WRITEONCE, "pintool", "bimodal_bits",
+    "12", "log2 of the counters of the bimodal predictor");
+KNOB<UINT32> KnobGshareBits(KNOB_MODE_WRITEONCE, "pintool", "gshare_bits",
+    "14", "log2 of the counters of gshare, also its bits of history");
+KNOB<UINT32> KnobTageTables(KNOB_MODE_WRITEONCE, "pintool", "tage_tables",
+    "4", "Tagged tables of TAGE (1 to 8)");
+KNOB<UINT32> KnobTageBits(KNOB_MODE_WRITEONCE, "pintool", "tage_bits",
+    "10", "log2 of the entries of each TAGE table and of its base predictor");
+KNOB<UINT32> KnobBtbBits(KNOB_MODE_WRITEONCE, "pintool", "btb_bits",
+    "9", "log2 of the entries of the BTB");
+
+#define MAX_TAGE_TABLES 8
+#define TAGE_TAG_BITS 9
+#define TAGE_AGING (1 << 18)
+
+enum Model { BIMODAL, GSHARE, TAGE, BTB, MODELS };
+
+struct BranchSite {
+  ADDRINT address;
+  string routine;
+  string file;
+  INT32 line;
+  BOOL indirect;
+  UINT64 executed;
+  UINT64 taken;
+  UINT64 misses[MODELS];
+};
+
+struct TageEntry {
+  UINT16 tag;
+  INT8 counter;   // -4 .. 3, taken if >= 0
+  UINT8 useful;   // 0 .. 3
+};
+
+struct BtbEntry {
+  ADDRINT branch;
+  ADDRINT target;
+};
+
+struct Predictors {
+  vector<UINT8> bimodal;   // 0 .. 3, taken if >= 2
+  vector<UINT8> gshare;
+  vector<UINT8> base;
+  vector<vector<TageEntry> > tage;
+  vector<BtbEntry> btb;
+  UINT64 history;
+  UINT64 updates;
+};
+
+static map<ADDRINT, BranchSite*> sites;
+static UINT32 tage_history[MAX_TAGE_TABLES];
+static TLS_KEY predictors_key;
+
+Predictors* get_predictors(THREADID tid){
+  Predictors *p = static_cast<Predictors*>(PIN_GetThreadData(predictors_key, tid));
+  if (p != NULL)
+    return p;
+
+  p = new Predictors();
+  p->bimodal.assign(1 << KnobBimodalBits.Value(), 2);
+  p->gshare.assign(1 << KnobGshareBits.Value(), 2);
+  p->base.assign(1 << KnobTageBits.Value(), 2);
+
+  TageEntry empty = {0, 0, 0};
+  p->tage.assign(KnobTageTables.Value(),
+                 vector<TageEntry>(1 << KnobTageBits.Value(), empty));
+
+  BtbEntry none = {0, 0};
+  p->btb.assign(1 << KnobBtbBits.Value(), none);
+
+  p->history = 0;
+  p->updates = 0;
+  PIN_SetThreadData(predictors_key, p, tid);
+  return p;
+}
+
+static VOID train(UINT8 &counter, BOOL taken){
+  if (taken && counter < 3)
+    counter++;
+  else if (!taken && counter > 0)
+    counter--;
+}
+
+// XOR of the `length` newest bits of history, `bits` at a time
+static UINT32 fold(UINT64 history, UINT32 length, UINT32 bits){
+  if (length < 64)
+    history &= (1ULL << length) - 1;
+
+  UINT32 folded = 0;
+  for (; history != 0; history >>= bits)
+    folded ^= history & ((1u << bits) - 1);
+  return folded;
+}
+
+// Predicts and trains TAGE, returns whether it mispredicted
+static BOOL tage(Predictors *p, ADDRINT pc, BOOL taken){
+  UINT32 bits = KnobTageBits.Value();
+  UINT32 mask = (1u << bits) - 1;
+  INT32 n = p->tage.size();
+
+  UINT32 index[MAX_TAGE_TABLES];
+  UINT16 tag[MAX_TAGE_TABLES];
+  INT32 provider = -1, alternate = -1;
+
+  for (INT32 i = n - 1; i >= 0; i--){
+    index[i] = (pc ^ (pc >> bits) ^ fold(p->history, tage_history[i], bits)) & mask;
+    tag[i] = (pc ^ fold(p->history, tage_history[i], TAGE_TAG_BITS) ^
+              (fold(p->history, tage_history[i], TAGE_TAG_BITS - 1) << 1)) &
+             ((1u << TAGE_TAG_BITS) - 1);
+
+    if (p->tage[i][index[i]].tag != tag[i])
+      continue;
+    if (provider < 0)
+      provider = i;
+    else if (alternate < 0)
+      alternate = i;
+  }
+
+  UINT8 &base = p->base[pc & mask];
+  BOOL alternate_prediction = alternate >= 0 ?
+      p->tage[alternate][index[alternate]].counter >= 0 : base >= 2;
+  BOOL prediction = alternate_prediction;
+
+  if (provider >= 0){
+    TageEntry &e = p->tage[provider][index[provider]];
+    prediction = e.counter >= 0;
+
+    // Useful if it gets right what the shorter history gets wrong
+    if (prediction != alternate_prediction){
+      if (prediction == taken && e.useful < 3)
+        e.useful++;
+      else if (prediction != taken && e.useful > 0)
+        e.useful--;
+    }
+
+    if (taken && e.counter < 3)
+      e.counter++;
+    else if (!taken && e.counter > -4)
+      e.counter--;
+  }
+  else
+    train(base, taken);
+
+  // A misprediction takes an entry in a table with longer history
+  if (prediction != taken){
+    INT32 i = provider + 1;
+    while (i < n && p->tage[i][index[i]].useful != 0)
+      i++;
+
+    if (i < n){
+      TageEntry &e = p->tage[i][index[i]];
+      e.tag = tag[i];
+      e.counter = taken ? 0 : -1;
+    }
+    else {
+      for (i = provider + 1; i < n; i++)
+        p->tage[i][index[i]].useful--;
+    }
+  }
+
+  if (++p->updates % TAGE_AGING == 0){
+    for (INT32 i = 0; i < n; i++)
+      for (size_t k = 0; k < p->tage[i].size(); k++)
+        p->tage[i][k].useful >>= 1;
+  }
+
+  return prediction != taken;
+}
+
+VOID conditional(BranchSite *site, BOOL taken, THREADID tid){
+  Predictors *p = get_predictors(tid);
+  ADDRINT pc = site->address;
+
+  UINT8 &bimodal = p->bimodal[pc & (p->bimodal.size() - 1)];
+  BOOL bimodal_miss = (bimodal >= 2) != taken;
+  train(bimodal, taken);
+
+  UINT64 mask = p->gshare.size() - 1;
+  UINT8 &gshare = p->gshare[(pc ^ p->history) & mask];
+  BOOL gshare_miss = (gshare >= 2) != taken;
+  train(gshare, taken);
+
+  BOOL tage_miss = tage(p, pc, taken);
+
+  p->history = (p->history << 1) | (taken ? 1 : 0);
+
+  if (valid){
+    site->executed += step;
+    if (taken)
+      site->taken += step;
+    if (bimodal_miss)
+      site->misses[BIMODAL] += step;
+    if (gshare_miss)
+      site->misses[GSHARE] += step;
+    if (tage_miss)
+      site->misses[TAGE] += step;
+  }
+}
+
+VOID indirect(BranchSite *site, ADDRINT target, THREADID tid){
+  Predictors *p = get_predictors(tid);
+  ADDRINT pc = site->address;
+
+  UINT32 bits = KnobBtbBits.Value();
+  BtbEntry &e = p->btb[(pc ^ (pc >> bits)) & (p->btb.size() - 1)];
+  BOOL miss = e.branch != pc || e.target != target;
+  e.branch = pc;
+  e.target = target;
+
+  if (valid){
+    site->executed += step;
+    if (miss)
+      site->misses[BTB] += step;
+  }
+}
+
+BranchSite* get_site(INS ins, RTN rtn, BOOL is_indirect){
+  ADDRINT address = INS_Address(ins);
+  map<ADDRINT, BranchSite*>::iterator it = sites.find(address);
+  if (it != sites.end())
+    return it->second;
+
+  BranchSite *site = new BranchSite();
+  site->address = address;
+  site->routine = RTN_Valid(rtn) ? RTN_Name(rtn) : "?";
+  site->line = 0;
+  PIN_GetSourceLocation(address, NULL, &site->line, &site->file);
+  site->indirect = is_indirect;
+  site->executed = 0;
+  site->taken = 0;
+  for (int m = 0; m < MODELS; m++)
+    site->misses[m] = 0;
+
+  sites[address] = site;
+  return site;
+}
+
+VOID Trace(TRACE trace, VOID *a) {
+  if (fast_forwarding())
+    return;
+
+  RTN rtn = TRACE_Rtn(trace);
+  if (RTN_Valid(rtn)){
+    if (RTN_Name(rtn) == "count_instruction" ||
+        RTN_Name(rtn) == "dump_csv")
+      return;
+  }
+
+  for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+
+      if (INS_IsBranch(ins) && INS_HasFallThrough(ins)){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)conditional,
+            IARG_PTR, get_site(ins, rtn, false),
+            IARG_BRANCH_TAKEN,
+            IARG_THREAD_ID,
+            IARG_END);
+      }
+      else if (INS_IsIndirectBranchOrCall(ins) && !INS_IsRet(ins)){
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)indirect,
+            IARG_PTR, get_site(ins, rtn, true),
+            IARG_BRANCH_TARGET_ADDR,
+            IARG_THREAD_ID,
+            IARG_END);
+      }
+
+    }
+  }
+}
+
+static UINT64 sort_misses(const BranchSite *s){
+  return s->misses[s->indirect ? BTB : TAGE];
+}
+
+static bool more_misses(const BranchSite *a, const BranchSite *b){
+  if (sort_misses(a) != sort_misses(b))
+    return sort_misses(a) > sort_misses(b);
+  return a->address < b->address;
+}
+
+static string rate(UINT64 misses, UINT64 executed){
+  std::ostringstream s;
+  s << std::fixed << std::setprecision(4)
+    << (executed ? (double)misses / executed : 0.0);
+  return s.str();
+}
+
+VOID write_site(const BranchSite *s, const string &address){
+  out << s->routine << ',' << s->file << ',' << s->line << ','
+      << address << ',' << (s->indirect ? "indirect" : "conditional") << ','
+      << s->executed << ',';
+
+  if (s->indirect)
+    out << ",,,," << rate(s->misses[BTB], s->executed);
+  else
+    out << s->taken << ',' << rate(s->misses[BIMODAL], s->executed) << ','
+        << rate(s->misses[GSHARE], s->executed) << ','
+        << rate(s->misses[TAGE], s->executed) << ',';
+
+  out << ',' << sort_misses(s) << '\n';
+}
+
+VOID Fini(INT32 code, VOID *v) {
+  vector<BranchSite*> executed;
+  BranchSite total[2];
+  for (int k = 0; k < 2; k++){
+    total[k].routine = "TOTAL";
+    total[k].line = 0;
+    total[k].indirect = k == 1;
+    total[k].executed = 0;
+    total[k].taken = 0;
+    for (int m = 0; m < MODELS; m++)
+      total[k].misses[m] = 0;
+  }
+
+  for (map<ADDRINT, BranchSite*>::iterator it = sites.begin(); it != sites.end(); it++){
+    BranchSite *s = it->second;
+    if (s->executed == 0)
+      continue;
+    executed.push_back(s);
+
+    BranchSite &t = total[s->indirect ? 1 : 0];
+    t.executed += s->executed;
+    t.taken += s->taken;
+    for (int m = 0; m < MODELS; m++)
+      t.misses[m] += s->misses[m];
+  }
+
+  std::sort(executed.begin(), executed.end(), more_misses);
+
+  out << "ROUTINE,FILE,LINE,ADDRESS,KIND,EXECUTED,TAKEN,BIMODAL,GSHARE,TAGE,BTB,MISSES\n";
+  for (size_t i = 0; i < executed.size(); i++){
+    std::ostringstream address;
+    address << "0x" << std::hex << executed[i]->address;
+    write_site(executed[i], address.str());
+  }
+  for (int k = 0; k < 2; k++)
+    if (total[k].executed != 0)
+      write_site(&total[k], "");
+
+  out.close();
+}
+
+/* ===================================================================== */
+/* Print Help Message                                                    */
+/* ===================================================================== */
+
+INT32 Usage() {
+  cerr << "Simulates bimodal, gshare and TAGE predictors on the conditional "
+          "branches and a BTB on the indirect ones, and writes the "
+          "misprediction rate of each branch (bpred.csv). "
+          "Compile the program with -g\n"
+          "\n";
+
+  return -1;
+}
+
+/* ===================================================================== */
+/* Main                                                                  */
+/* ===================================================================== */
+
+int main(int argc, char *argv[]) {
+  if (PIN_Init(argc, argv)) {
+    return Usage();
+  }
+
+  if (KnobTageTables.Value() < 1 || KnobTageTables.Value() > MAX_TAGE_TABLES){
+    cerr << "-tage_tables must be between 1 and " << MAX_TAGE_TABLES << "\n";
+    return -1;
+  }
+
+  // Geometric history lengths, from 4 to 64 bits
+  UINT32 n = KnobTageTables.Value();
+  for (UINT32 i = 0; i < n; i++)
+    tage_history[i] = n == 1 ? 16 : (UINT32)(4 * pow(16.0, (double)i / (n - 1)) + 0.5);
+
+  init_sampling();
+
+  out.open("bpred.csv");
+
+  predictors_key = PIN_CreateThreadDataKey(NULL);
+
+  PIN_InitSymbols();
+  IMG_AddInstrumentFunction(Image, 0);
+
+  TRACE_AddInstrumentFunction(Trace, 0);
+
+  PIN_AddFiniFunction(Fini, NULL);
+
+  // Start the program, never returns
+  PIN_StartProgram();
+
+  return 0;
+}
@@ -8,74 +8,19 @@
 #include "pin.H"
 #include "instlib.H"
 #include "lib.H"
+#include "sampling.H"
+#include "output.H"
+#include "categories.H"
 
 using namespace INSTLIB;
 
 
-ofstream out;
 FILTER filter;
 
-void count_inst(const string *type){
-  if (valid){
-    if (prefix == "before")
-      bef[*type]++;
-    else if (prefix == "main")
-      ma[*type]++;
-    else
-      en[*type]++;
-  }
-}
-
-template<typename T, size_t N>
-T * end(T (&ra)[N]) {
-    return ra + N;
-}
 
 void init(){
 
-  const char *ADD[] = {"ADC", "ADD", "ADD_LOCK", "INC", "PADDD", "PADDQ", "XADD_LOCK"};
-  const char *FADD[] = {"ADDPD", "ADDPS", "ADDSD", "ADDSS", "FADD", "FADDP", "VADDSD"};
-  const char *SUB[] = {"DEC", "DEC_LOCK", "PSUBB", "SBB",
-                                          "SUB", "VPSUBB"};  
-  const char *FSUB[] = {"FSUB", "FSUBP", "FSUBRP", "SUBPD",
-                                           "SUBSD", "SUBSS", "VSUBSD"};
-  const char *MUL[] = {"IMUL", "MUL"};
-  const char *FMUL[] = {"FMUL", "FMULP", "MULPD", "MULPS",
-                                           "MULSD", "MULSS", "VMULSD"};
-  const char *DIV[] = {"DIV", "IDIV"};
-  const char *FDIV[] = {"DIVPD", "DIVSD", "DIVSS", "FDIV", "VDIVSD"};
-  const char *AND[] = {"AND", "ANDNPD", "ANDPD", "ANDPS", "VANDNPD",
-                               "VANDPD", "VPAND", "VPANDN"};
-  const char *OR[] = {"OR", "OR_LOCK", "POR", "VORPD", "VPOR"};
-  const char *CMP[] = {"CMP", "CMPSD_XMM", "CMPSS", "CMPXCHG", "CMPXCHG_LOCK", "PCMPEQB",
-      "PCMPEQD", "PCMPISTRI", "PTEST", "REPE_CMPSB", "TEST", "VPCMPEQB",
-      "VPCMPGTB"};
-  const char *FCMP[] = {"FUCOMIP", "UCOMISD", "UCOMISS",
-                                           "VCMPSD", "VUCOMISD"};
-  const char *SHL[] = {"PSLLDQ", "SHL", "SHLD"};
-  const char *ASHR[] = {"SAR"};
-  const char *LSHR[] = {"PSRLDQ", "SHR", "SHRD"};
-  const char *CALL[] = {"CALL_NEAR", "SYSCALL"};
-  const char *XOR[] = {"PXOR", "VPXOR", "VXORPD", "XOR",
-                                          "XORPD", "XORPS"};
-
-  types["ADD"] = vector<string>(ADD, end(ADD));
-  types["FADD"] = vector<string>(FADD, end(FADD));
-  types["SUB"] = vector<string>(SUB, end(SUB));
-  types["FSUB"] = vector<string>(FSUB, end(FSUB));
-  types["MUL"] = vector<string>(MUL, end(MUL));
-  types["FMUL"] = vector<string>(FMUL, end(FMUL));
-  types["DIV"] = vector<string>(DIV, end(DIV));
-  types["FDIV"] = vector<string>(FDIV, end(FDIV));
-  types["AND"] = vector<string>(AND, end(AND));
-  types["OR"] = vector<string>(OR, end(OR));
-  types["CMP"] = vector<string>(CMP, end(CMP));
-  types["FCMP"] = vector<string>(FCMP, end(FCMP));
-  types["SHL"] = vector<string>(SHL, end(SHL));
-  types["ASHR"] = vector<string>(ASHR, end(ASHR));
-  types["LSHR"] = vector<string>(LSHR, end(LSHR));
-  types["CALL"] = vector<string>(CALL, end(CALL));
-  types["XOR"] = vector<string>(XOR, end(XOR));
+  init_types();
 
   init_if_not_exists(new string("ADD"));
   init_if_not_exists(new string("FADD"));
@@ -97,19 +42,10 @@ void init(){
 
 }
 
-std::string check_mnemonic(const string &m){
-
-  for (map<string, vector<string> >::iterator it = types.begin(); it != types.end(); it++){
-    if (std::find(it->second.begin(), it->second.end(), m) != it->second.end()){
-      return it->first;
-    }
-  }
-  
-  return "";
-}
-
-
 VOID Trace(TRACE trace, VOID *a) {
+  if (fast_forwarding())
+    return;
+
   // if (!filter.SelectTrace(trace))
   //   return;
 
@@ -127,6 +63,7 @@ VOID Trace(TRACE trace, VOID *a) {
       if (s.size() != 0){
         INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)count_inst,
             IARG_PTR, new string(s),
+            IARG_THREAD_ID,
             // IARG_PTR, new string(INS_Mnemonic(ins)),
             IARG_END);
       }
@@ -136,7 +73,7 @@ VOID Trace(TRACE trace, VOID *a) {
 }
 
 
-VOID Fini(INT32 code, VOID *v) {
+VOID Dump(std::ostream &out) {
 
   for (map<string, vector<string> >::iterator it = types.begin(); it != types.end(); it++){
     out << it->first << "_before,";
@@ -150,7 +87,6 @@ VOID Fini(INT32 code, VOID *v) {
   }
   out << "\n";
   
-  out.close();
 }
 
 /* ===================================================================== */
@@ -173,8 +109,10 @@ int main(int argc, char *argv[]) {
   if (PIN_Init(argc, argv)) {
     return Usage();
   }
+
+  init_sampling();
   
-  out.open("binops.csv");
+  init_output("binops.csv", Dump);
   
   init();
 
@@ -185,8 +123,6 @@ int main(int argc, char *argv[]) {
 
   TRACE_AddInstrumentFunction(Trace, 0);
 
-  PIN_AddFiniFunction(Fini, NULL);
-
   // Start the program, never returns
   PIN_StartProgram();
 
@@ -7,24 +7,18 @@
 #include "pin.H"
 #include "instlib.H"
 #include "lib.H"
+#include "sampling.H"
+#include "output.H"
 
 using namespace INSTLIB;
 
-ofstream out;
 FILTER filter;
 
-void count_inst(const string *type){
-  if (valid){
-    if (prefix == "before")
-      bef[*type]++;
-    else if (prefix == "main")
-      ma[*type]++;
-    else
-      en[*type]++;
-  }
-}
 
 VOID Trace(TRACE trace, VOID *a) {
+  if (fast_forwarding())
+    return;
+
   // if (!filter.SelectTrace(trace))
   //   return;
 
@@ -48,11 +42,13 @@ VOID Trace(TRACE trace, VOID *a) {
         if (INS_IsIndirectBranchOrCall(ins)){
           INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)count_inst,
               IARG_PTR, new string("indirect"),
+              IARG_THREAD_ID,
               IARG_END);
         }
         if (INS_IsDirectBranchOrCall(ins)){
           INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)count_inst,
               IARG_PTR, new string("br"),
+              IARG_THREAD_ID,
               IARG_END);
         }
       }
@@ -61,11 +57,10 @@ VOID Trace(TRACE trace, VOID *a) {
   }
 }
 
-VOID Fini(INT32 code, VOID *v) {
+VOID Dump(std::ostream &out) {
   out << "br_before, br_main, br_end, indirect_before, indirect_main, indirect_end\n";
   out << bef["br"] << ", " << ma["br"] << ", " << en["br"] << ", ";
   out << bef["indirect"] << ", " << ma["indirect"] << ", " << en["indirect"] << "\n";
-  out.close();
 }
 
 /* ===================================================================== */
@@ -88,8 +83,10 @@ int main(int argc, char *argv[]) {
   if (PIN_Init(argc, argv)) {
     return Usage();
   }
+
+  init_sampling();
   
-  out.open("br.csv");
+  init_output("br.csv", Dump);
 
   // filter.Activate();
 
@@ -98,8 +95,6 @@ int main(int argc, char *argv[]) {
 
   TRACE_AddInstrumentFunction(Trace, 0);
 
-  PIN_AddFiniFunction(Fini, NULL);
-
   // Start the program, never returns
   PIN_StartProgram();
 
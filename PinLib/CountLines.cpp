@@ -0,0 +1,158 @@
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "pin.H"
+#include "instlib.H"
+#include "lib.H"
+#include "sampling.H"
+#include "categories.H"
+
+using namespace INSTLIB;
+
+/*
+  Counts the executed instructions per source line, using the same classes
+  as CountBinOps plus LOAD, STORE and BR. The output (pin_lines.csv) has the
+  layout of the lines.csv file written by the Instrument pass when it runs
+  with -instrument-lines, so both can be joined by Tools/join_lines.
+*/
+
+ofstream out;
+FILTER filter;
+
+struct Site {
+  string file;
+  INT32 line;
+  string category;
+
+  bool operator<(const Site &o) const {
+    if (file != o.file)
+      return file < o.file;
+    if (line != o.line)
+      return line < o.line;
+    return category < o.category;
+  }
+};
+
+static map<Site, UINT64*> sites;
+
+VOID count_line(UINT64 *counter){
+  if (valid)
+    (*counter) += step;
+}
+
+UINT64* get_counter(const string &file, INT32 line, const string &category){
+  Site s;
+  s.file = file;
+  s.line = line;
+  s.category = category;
+
+  map<Site, UINT64*>::iterator it = sites.find(s);
+  if (it != sites.end())
+    return it->second;
+
+  UINT64 *counter = new UINT64(0);
+  sites[s] = counter;
+  return counter;
+}
+
+VOID insert_count(INS ins, const string &file, INT32 line, const string &category){
+  INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)count_line,
+      IARG_PTR, get_counter(file, line, category),
+      IARG_END);
+}
+
+VOID Trace(TRACE trace, VOID *a) {
+  if (fast_forwarding())
+    return;
+
+  RTN rtn = TRACE_Rtn(trace);
+  if (RTN_Valid(rtn)){
+    if (RTN_Name(rtn) == "count_instruction" ||
+        RTN_Name(rtn) == "dump_csv" ||
+        RTN_Name(rtn) == "register_lines" ||
+        RTN_Name(rtn) == "dump_lines")
+      return;
+  }
+
+  for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+
+      INT32 line = 0;
+      string file;
+      PIN_GetSourceLocation(INS_Address(ins), NULL, &line, &file);
+
+      // No debug info for this instruction
+      if (line == 0)
+        continue;
+
+      std::string s = check_mnemonic(INS_Mnemonic(ins));
+      if (s.size() != 0)
+        insert_count(ins, file, line, s);
+
+      if (INS_IsMemoryRead(ins))
+        insert_count(ins, file, line, "LOAD");
+      if (INS_IsMemoryWrite(ins))
+        insert_count(ins, file, line, "STORE");
+      if (INS_IsBranch(ins))
+        insert_count(ins, file, line, "BR");
+
+    }
+  }
+}
+
+VOID Fini(INT32 code, VOID *v) {
+  out << "FILE,LINE,CATEGORY,COUNT\n";
+
+  for (map<Site, UINT64*>::iterator it = sites.begin(); it != sites.end(); it++){
+    if (*it->second == 0)
+      continue;
+    out << it->first.file << ',' << it->first.line << ','
+        << it->first.category << ',' << *it->second << '\n';
+  }
+
+  out.close();
+}
+
+/* ===================================================================== */
+/* Print Help Message                                                    */
+/* ===================================================================== */
+
+INT32 Usage() {
+  cerr << "Counts the executed instructions per source line. "
+          "Compile the program with -g\n"
+          "\n";
+
+  return -1;
+}
+
+/* ===================================================================== */
+/* Main                                                                  */
+/* ===================================================================== */
+
+int main(int argc, char *argv[]) {
+  if (PIN_Init(argc, argv)) {
+    return Usage();
+  }
+
+  init_sampling();
+
+  out.open("pin_lines.csv");
+
+  init_types();
+
+  PIN_InitSymbols();
+  IMG_AddInstrumentFunction(Image, 0);
+
+  TRACE_AddInstrumentFunction(Trace, 0);
+
+  PIN_AddFiniFunction(Fini, NULL);
+
+  // Start the program, never returns
+  PIN_StartProgram();
+
+  return 0;
+}
@@ -7,24 +7,18 @@
 #include "pin.H"
 #include "instlib.H"
 #include "lib.H"
+#include "sampling.H"
+#include "output.H"
 
 using namespace INSTLIB;
 
-ofstream out;
 FILTER filter;
 
-void count_inst(const string *type){
-  if (valid){
-    if (prefix == "before")
-      bef[*type]++;
-    else if (prefix == "main")
-      ma[*type]++;
-    else
-      en[*type]++;
-  }
-}
 
 VOID Trace(TRACE trace, VOID *a) {
+  if (fast_forwarding())
+    return;
+
   // if (!filter.SelectTrace(trace))
   //   return;
 
@@ -41,6 +35,7 @@ VOID Trace(TRACE trace, VOID *a) {
       if (INS_IsMemoryRead(ins)){
         INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)count_inst,
             IARG_PTR, new string(load),
+            IARG_THREAD_ID,
             // IARG_PTR, new string(INS_Mnemonic(ins)),
             IARG_END);
       }
@@ -58,10 +53,9 @@ VOID Trace(TRACE trace, VOID *a) {
   }
 }
 
-VOID Fini(INT32 code, VOID *v) {
+VOID Dump(std::ostream &out) {
   out << "load_before, load_main, load_end\n";
   out << bef["load"] << ", " << ma["load"] << ", " << en["load"] << "\n";
-  out.close();
 }
 
 /* ===================================================================== */
@@ -84,8 +78,10 @@ int main(int argc, char *argv[]) {
   if (PIN_Init(argc, argv)) {
     return Usage();
   }
+
+  init_sampling();
   
-  out.open("loads.csv");
+  init_output("loads.csv", Dump);
 
   // filter.Activate();
 
@@ -94,8 +90,6 @@ int main(int argc, char *argv[]) {
 
   TRACE_AddInstrumentFunction(Trace, 0);
 
-  PIN_AddFiniFunction(Fini, NULL);
-
   // Start the program, never returns
   PIN_StartProgram();
 
@@ -0,0 +1,143 @@
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "pin.H"
+#include "instlib.H"
+#include "lib.H"
+#include "sampling.H"
+#include "simd.H"
+
+using namespace INSTLIB;
+
+/*
+  Counts the executed SIMD instructions of each routine by ISA extension,
+  packed or scalar, vector width and element size (simd.csv), and
+  summarizes the lane utilization of every routine (simd_routines.csv):
+  the lanes that did useful work over the lanes of the registers used.
+  A routine that runs scalar SSE on doubles uses 50% of its lanes, a
+  vectorized one close to 100%.
+*/
+
+ofstream out;
+
+static map<string, map<SIMDClass, UINT64*> > routines;
+
+VOID count_simd(UINT64 *counter){
+  if (valid)
+    (*counter) += step;
+}
+
+UINT64* get_counter(const string &routine, const SIMDClass &c){
+  map<SIMDClass, UINT64*> &classes = routines[routine];
+
+  map<SIMDClass, UINT64*>::iterator it = classes.find(c);
+  if (it != classes.end())
+    return it->second;
+
+  UINT64 *counter = new UINT64(0);
+  classes[c] = counter;
+  return counter;
+}
+
+VOID Trace(TRACE trace, VOID *a) {
+  if (fast_forwarding())
+    return;
+
+  RTN rtn = TRACE_Rtn(trace);
+  string routine = RTN_Valid(rtn) ? RTN_Name(rtn) : "unknown";
+  if (routine == "count_instruction" || routine == "dump_csv")
+    return;
+
+  for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+      SIMDClass c;
+      if (!classify_simd(ins, c))
+        continue;
+
+      INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)count_simd,
+          IARG_PTR, get_counter(routine, c),
+          IARG_END);
+    }
+  }
+}
+
+VOID Fini(INT32 code, VOID *v) {
+  out << "ROUTINE,EXTENSION,KIND,WIDTH,ELEMENT,COUNT\n";
+
+  std::ofstream summary("simd_routines.csv");
+  summary << "ROUTINE,SIMD,PACKED,SCALAR,LANES,SLOTS,UTILIZATION\n";
+
+  for (map<string, map<SIMDClass, UINT64*> >::iterator r = routines.begin();
+       r != routines.end(); r++){
+    UINT64 total = 0, packed = 0, lanes = 0, slots = 0;
+
+    for (map<SIMDClass, UINT64*>::iterator it = r->second.begin();
+         it != r->second.end(); it++){
+      const SIMDClass &c = it->first;
+      UINT64 count = *it->second;
+      if (count == 0)
+        continue;
+
+      out << r->first << ',' << c.extension << ','
+          << (c.packed ? "packed" : "scalar") << ',' << c.width << ','
+          << c.element << ',' << count << '\n';
+
+      total += count;
+      if (c.packed)
+        packed += count;
+      lanes += count * c.lanes();
+      slots += count * c.slots();
+    }
+
+    if (total == 0)
+      continue;
+
+    summary << r->first << ',' << total << ',' << packed << ','
+            << total - packed << ',' << lanes << ',' << slots << ','
+            << (double)lanes / slots << '\n';
+  }
+
+  summary.close();
+  out.close();
+}
+
+/* ===================================================================== */
+/* Print Help Message                                                    */
+/* ===================================================================== */
+
+INT32 Usage() {
+  cerr << "Counts the SIMD instructions of each routine by ISA extension, "
+          "packed/scalar and width\n"
+          "\n";
+
+  return -1;
+}
+
+/* ===================================================================== */
+/* Main                                                                  */
+/* ===================================================================== */
+
+int main(int argc, char *argv[]) {
+  if (PIN_Init(argc, argv)) {
+    return Usage();
+  }
+
+  init_sampling();
+
+  out.open("simd.csv");
+
+  PIN_InitSymbols();
+  IMG_AddInstrumentFunction(Image, 0);
+
+  TRACE_AddInstrumentFunction(Trace, 0);
+
+  PIN_AddFiniFunction(Fini, NULL);
+
+  // Start the program, never returns
+  PIN_StartProgram();
+
+  return 0;
+}
@@ -7,26 +7,20 @@
 #include "pin.H"
 #include "instlib.H"
 #include "lib.H"
+#include "sampling.H"
+#include "output.H"
 
 using namespace INSTLIB;
 
-ofstream out;
 FILTER filter;
 
-void count_inst(const string *type){
-  if (valid){
-    if (prefix == "before")
-      bef[*type]++;
-    else if (prefix == "main")
-      ma[*type]++;
-    else
-      en[*type]++;
-  }
-}
 
 
 
 VOID Trace(TRACE trace, VOID *a) {
+  if (fast_forwarding())
+    return;
+
   // if (!filter.SelectTrace(trace))
   //   return;
 
@@ -43,6 +37,7 @@ VOID Trace(TRACE trace, VOID *a) {
       if (INS_IsMemoryWrite(ins)){
         INS_InsertPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)count_inst,
             IARG_PTR, new string(store),
+            IARG_THREAD_ID,
             // IARG_PTR, new string(INS_Mnemonic(ins)),
             IARG_END);
       }
@@ -52,10 +47,9 @@ VOID Trace(TRACE trace, VOID *a) {
 }
 
 
-VOID Fini(INT32 code, VOID *v) {
+VOID Dump(std::ostream &out) {
   out << "store_before, store_main, store_end\n";
   out << bef["store"] << ", " << ma["store"] << ", " << en["store"] << "\n";
-  out.close();
 }
 
 /* ===================================================================== */
@@ -78,8 +72,10 @@ int main(int argc, char *argv[]) {
   if (PIN_Init(argc, argv)) {
     return Usage();
   }
+
+  init_sampling();
   
-  out.open("stores.csv");
+  init_output("stores.csv", Dump);
 
   // filter.Activate();
 
@@ -88,8 +84,6 @@ int main(int argc, char *argv[]) {
 
   TRACE_AddInstrumentFunction(Trace, 0);
 
-  PIN_AddFiniFunction(Fini, NULL);
-
   // Start the program, never returns
   PIN_StartProgram();
 
@@ -15,16 +15,6 @@ std::set<std::string> opcodes;
 ofstream out;
 FILTER filter;
 
-void count_inst(const string *type){
-  if (valid){
-    if (prefix == "before")
-      bef[*type]++;
-    else if (prefix == "main")
-      ma[*type]++;
-    else
-      en[*type]++;
-  }
-}
 
 std::string check_mnemonic(const string &m){
 
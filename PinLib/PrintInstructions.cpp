@@ -1,25 +1,64 @@
-#include <iomanip>
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
 #include <map>
-#include <set>
+#include <string>
+#include <vector>
 
 #include "pin.H"
 #include "instlib.H"
 
 using namespace INSTLIB;
 
-ofstream out;
-FILTER filter;
-std::map<std::string, set<std::string> > mapa;
+/*
+  Annotated disassembly of the executed code. Every instruction is stored
+  once, by address, the first time a trace with it is instrumented; a
+  trace instrumented again only adds its blocks. The blocks count their
+  executions, and Fini adds them to their instructions and writes the
+  listing to print.out: the routines from the hottest, each one in
+  address order, with the share of the executed instructions and the
+  count of every instruction, as in perf annotate.
+*/
 
-VOID Image(IMG img, VOID *v){
+FILTER filter;
 
-  // for (SYM sym = IMG_RegsymHead(img); SYM_Valid(sym); sym = SYM_Next(sym)){
-  //   string undFuncName = PIN_UndecorateSymbolName(SYM_Name(sym), UNDECORATION_NAME_ONLY);
-  //   out << undFuncName << ' ' << SYM_Name(sym) << endl;
-  // }
-  // out << endl;
+struct Instruction {
+  ADDRINT address;
+  string routine;
+  string disassembly;
+  string category;
+  bool load, store;
+  UINT64 count;
+};
+
+struct Block {
+  UINT64 count;
+  vector<Instruction*> instructions;
+};
+
+static map<ADDRINT, Instruction*> database;
+static vector<Block*> blocks;
+
+VOID count_block(UINT64 *counter){
+  ++*counter;
+}
 
+Instruction* lookup(INS ins, RTN rtn){
+  ADDRINT address = INS_Address(ins);
+  map<ADDRINT, Instruction*>::iterator it = database.find(address);
+  if (it != database.end())
+    return it->second;
+
+  Instruction *i = new Instruction();
+  i->address = address;
+  i->routine = RTN_Valid(rtn) ? RTN_Name(rtn) : "?";
+  i->disassembly = INS_Disassemble(ins);
+  i->category = CATEGORY_StringShort(INS_Category(ins));
+  i->load = INS_IsMemoryRead(ins);
+  i->store = INS_IsMemoryWrite(ins);
+  i->count = 0;
+  database[address] = i;
+  return i;
 }
 
 VOID Trace(TRACE trace, VOID *a) {
@@ -27,45 +66,80 @@ VOID Trace(TRACE trace, VOID *a) {
   if (!filter.SelectTrace(trace))
     return;
 
-  for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
-    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
-
-      RTN rtn = TRACE_Rtn(trace);
-      
-      bool load = false, store = false;
-      
-      if (INS_IsMemoryRead(ins))
-        load = true;
-      if (INS_IsMemoryWrite(ins))
-        store = true;
-      
-      if (RTN_Valid(rtn)){
-        IMG img = SEC_Img(RTN_Sec(rtn));
-        if (IMG_Valid(img)){
-          /* out << IMG_Name(img) << ":" << RTN_Name(rtn) << " " ; */
-          out << RTN_Name(rtn) << " " ;
-        }
-
-      }
-      
-      out << INS_Disassemble(ins) << ' ' << (load == 1 ? "[L]" : "") << ' ' << (store == 1 ? "[S]" : "") << ' ' << INS_Mnemonic(ins) << endl;
-
-      std::string m = INS_Mnemonic(ins);
-      if (m.find("SUB") != std::string::npos){
-        mapa["SUB"].insert (m);
-      }
+  RTN rtn = TRACE_Rtn(trace);
 
-    }
+  for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+    Block *block = new Block();
+    block->count = 0;
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+      block->instructions.push_back(lookup(ins, rtn));
+    blocks.push_back(block);
+
+    BBL_InsertCall(bbl, IPOINT_BEFORE, (AFUNPTR)count_block,
+        IARG_PTR, &block->count, IARG_END);
   }
 }
 
+struct Routine {
+  string name;
+  UINT64 count;
+  vector<Instruction*> instructions;
+};
+
+static bool hotter(const Routine *a, const Routine *b){
+  return a->count > b->count;
+}
+
 VOID Fini(INT32 code, VOID *v) {
-  for (set<std::string>::iterator it = mapa["SUB"].begin();
-       it != mapa["SUB"].end(); it++){
-    out << *it << ' ';
+  for (size_t b=0; b<blocks.size(); b++)
+    for (size_t i=0; i<blocks[b]->instructions.size(); i++)
+      blocks[b]->instructions[i]->count += blocks[b]->count;
+
+  // The database is in address order, and so are the routines
+  map<string, Routine*> by_name;
+  vector<Routine*> routines;
+  UINT64 total = 0;
+  for (map<ADDRINT, Instruction*>::iterator it = database.begin();
+       it != database.end(); it++){
+    Instruction *i = it->second;
+    Routine *&r = by_name[i->routine];
+    if (r == NULL){
+      r = new Routine();
+      r->name = i->routine;
+      r->count = 0;
+      routines.push_back(r);
+    }
+    r->instructions.push_back(i);
+    r->count += i->count;
+    total += i->count;
   }
-  out << "\n";
-  out.close();
+
+  std::stable_sort(routines.begin(), routines.end(), hotter);
+
+  FILE *out = fopen("print.out", "w");
+  if (out == NULL){
+    cerr << "Cannot create file print.out\n";
+    return;
+  }
+
+  for (size_t r=0; r<routines.size(); r++){
+    Routine *routine = routines[r];
+    fprintf(out, "%s: %llu instructions (%.2f%%)\n", routine->name.c_str(),
+            (unsigned long long)routine->count,
+            total ? 100.0 * routine->count / total : 0.0);
+
+    for (size_t k=0; k<routine->instructions.size(); k++){
+      Instruction *i = routine->instructions[k];
+      fprintf(out, "%7.2f%% %14llu  %16llx  %-40s %-3s %-3s %s\n",
+              routine->count ? 100.0 * i->count / routine->count : 0.0,
+              (unsigned long long)i->count, (unsigned long long)i->address,
+              i->disassembly.c_str(), i->load ? "[L]" : "",
+              i->store ? "[S]" : "", i->category.c_str());
+    }
+    fprintf(out, "\n");
+  }
+
+  fclose(out);
 }
 
 /* ===================================================================== */
@@ -73,7 +147,8 @@ VOID Fini(INT32 code, VOID *v) {
 /* ===================================================================== */
 
 INT32 Usage() {
-  cerr << "Error\n";
+  cerr << "Writes the disassembly of the executed routines with the "
+          "execution count of each instruction (print.out)\n";
   return -1;
 }
 
@@ -86,10 +161,7 @@ int main(int argc, char *argv[]) {
     return Usage();
   }
 
-  out.open("print.out");
-
   PIN_InitSymbols();
-  IMG_AddInstrumentFunction(Image, 0);
 
   filter.Activate();
 
@@ -0,0 +1,127 @@
+/*
+  Merges the coverage.bin files written by programs instrumented with
+  -instrument-coverage, for instance by several runs of a test suite:
+
+    covmerge -o merged.bin run1/coverage.bin run2/coverage.bin ...
+
+  A block is covered in the result when it is covered in any input. The
+  inputs must come from the same binary: the number of tables, their
+  number of blocks and the hash of their sites must match. The number of
+  covered blocks of each table is written to the standard output.
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct Table {
+  uint32_t blocks;
+  uint64_t hash;
+  std::vector<unsigned char> bits;
+};
+
+template<class T> static bool get(std::ifstream &in, T &value){
+  return (bool)in.read((char*)&value, sizeof(T));
+}
+
+template<class T> static void put(std::ofstream &out, const T &value){
+  out.write((const char*)&value, sizeof(T));
+}
+
+static bool read_coverage(const char *filename, std::vector<Table> &tables){
+  std::ifstream in(filename, std::ios::binary);
+  char magic[4];
+  uint32_t n;
+  if (!in.read(magic, 4) || std::memcmp(magic, "COV1", 4) || !get(in, n)){
+    std::cerr << "Cannot read " << filename << "\n";
+    return false;
+  }
+
+  tables.resize(n);
+  for (auto &t : tables){
+    if (!get(in, t.blocks) || !get(in, t.hash)){
+      std::cerr << "Truncated file " << filename << "\n";
+      return false;
+    }
+    t.bits.resize((t.blocks + 7) / 8);
+    if (!in.read((char*)t.bits.data(), t.bits.size())){
+      std::cerr << "Truncated file " << filename << "\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static unsigned covered(const Table &t){
+  unsigned n = 0;
+  for (unsigned char byte : t.bits)
+    for (; byte; byte &= byte - 1)
+      ++n;
+  return n;
+}
+
+int main(int argc, char *argv[]){
+  const char *output = nullptr;
+  std::vector<const char*> inputs;
+
+  for (int i=1; i<argc; i++){
+    std::string arg = argv[i];
+    if (arg == "-o" && i + 1 < argc) output = argv[++i];
+    else inputs.push_back(argv[i]);
+  }
+
+  if (inputs.empty()){
+    std::cerr << "Usage: " << argv[0] << " [-o merged.bin] coverage.bin...\n";
+    return 1;
+  }
+
+  std::vector<Table> merged;
+  if (!read_coverage(inputs[0], merged))
+    return 1;
+
+  for (size_t i=1; i<inputs.size(); i++){
+    std::vector<Table> tables;
+    if (!read_coverage(inputs[i], tables))
+      return 1;
+
+    if (tables.size() != merged.size()){
+      std::cerr << inputs[i] << " does not come from the same program\n";
+      return 1;
+    }
+
+    for (size_t t=0; t<tables.size(); t++){
+      if (tables[t].blocks != merged[t].blocks ||
+          tables[t].hash != merged[t].hash){
+        std::cerr << inputs[i] << " does not come from the same program\n";
+        return 1;
+      }
+      for (size_t b=0; b<tables[t].bits.size(); b++)
+        merged[t].bits[b] |= tables[t].bits[b];
+    }
+  }
+
+  if (output){
+    std::ofstream out(output, std::ios::binary);
+    if (!out){
+      std::cerr << "Cannot create file " << output << "\n";
+      return 1;
+    }
+    out.write("COV1", 4);
+    put(out, (uint32_t)merged.size());
+    for (auto &t : merged){
+      put(out, t.blocks);
+      put(out, t.hash);
+      out.write((const char*)t.bits.data(), t.bits.size());
+    }
+  }
+
+  std::cout << "TABLE,BLOCKS,COVERED\n";
+  for (size_t t=0; t<merged.size(); t++)
+    std::cout << t << "," << merged[t].blocks << "," << covered(merged[t]) << "\n";
+
+  return 0;
+}
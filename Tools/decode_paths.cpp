@@ -0,0 +1,206 @@
+/*
+  Decodes the paths counted by a program instrumented with
+  -instrument-paths into the blocks they go through:
+
+    decode_paths -n 20 paths.csv paths.graph > hot_paths.csv
+
+  Both files are written by the runtime. paths.graph has the Ball-Larus
+  DAG of each function: its blocks and its edges with their values. The
+  id of a path is the sum of the values of its edges, so it is decoded
+  from the entry by following, at each block, the edge with the largest
+  value not above what is left of the id. A path that starts after a back
+  edge begins at a loop header (START is "loop"), and a path that ends in
+  a back edge goes around the loop again (END is "back").
+
+  The -n most frequent paths are written, with their share of the
+  executions of the paths of their function.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct Edge {
+  unsigned to;
+  uint64_t value;
+  std::string kind;
+};
+
+struct Graph {
+  std::vector<std::string> blocks;
+  std::vector<std::vector<Edge> > out;
+};
+
+struct Path {
+  std::string function, file;
+  uint64_t id, count;
+};
+
+typedef std::pair<std::string, std::string> Key;
+
+static bool read_graphs(const char *filename, std::map<Key, Graph> &graphs){
+  std::ifstream in(filename);
+  if (!in){
+    std::cerr << "Cannot read " << filename << "\n";
+    return false;
+  }
+
+  Graph *g = nullptr;
+  std::string line;
+  while (std::getline(in, line)){
+    std::istringstream ss(line);
+    std::string tag;
+    ss >> tag;
+
+    if (tag == "function"){
+      std::string function, file;
+      ss >> function >> file;
+      g = &graphs[Key(function, file)];
+      *g = Graph();
+    }
+    else if (tag == "block" && g){
+      unsigned index;
+      std::string name, line;
+      ss >> index >> name >> line;
+      if (g->blocks.size() <= index)
+        g->blocks.resize(index + 1);
+      g->blocks[index] = name + ":" + line;
+    }
+    else if (tag == "edge" && g){
+      unsigned from;
+      Edge e;
+      ss >> from >> e.to >> e.value >> e.kind;
+      // The virtual exit is the last node
+      if (g->out.size() <= std::max(from, e.to))
+        g->out.resize(std::max(from, e.to) + 1);
+      g->out[from].push_back(e);
+    }
+  }
+
+  return true;
+}
+
+static bool read_paths(const char *filename, std::vector<Path> &paths){
+  std::ifstream in(filename);
+  std::string line;
+  if (!in || !std::getline(in, line)){
+    std::cerr << "Cannot read " << filename << "\n";
+    return false;
+  }
+
+  // FUNCTION,FILE,PATH,COUNT
+  while (std::getline(in, line)){
+    std::vector<std::string> fields;
+    std::stringstream ss(line);
+    std::string field;
+    while (std::getline(ss, field, ','))
+      fields.push_back(field);
+    if (fields.size() < 4)
+      continue;
+
+    Path p;
+    p.function = fields[0];
+    p.file = fields[1].empty() ? "-" : fields[1];
+    p.id = std::stoull(fields[2]);
+    p.count = std::stoull(fields[3]);
+    paths.push_back(p);
+  }
+
+  return true;
+}
+
+// Writes START,END,BLOCKS for the path `id` of g
+static bool decode(const Graph &g, uint64_t id, std::ostream &out){
+  unsigned exit = g.blocks.size();
+  unsigned node = 0;
+  std::string start = "entry", end = "return";
+  std::vector<std::string> blocks(1, g.blocks[0]);
+
+  while (node != exit){
+    if (node >= g.out.size() || g.out[node].empty())
+      return false;
+
+    const Edge *next = nullptr;
+    for (auto &e : g.out[node])
+      if (e.value <= id && (!next || e.value > next->value))
+        next = &e;
+    if (!next)
+      return false;
+
+    id -= next->value;
+    if (next->kind == "restart"){
+      start = "loop";
+      blocks.clear();
+    }
+    else if (next->kind == "back"){
+      end = "back";
+    }
+
+    node = next->to;
+    if (node != exit)
+      blocks.push_back(g.blocks[node]);
+  }
+
+  out << start << "," << end << ",";
+  for (size_t i=0; i<blocks.size(); i++)
+    out << (i ? " " : "") << blocks[i];
+  return id == 0;
+}
+
+int main(int argc, char *argv[]){
+  unsigned n = 10;
+  std::vector<const char*> files;
+
+  for (int i=1; i<argc; i++){
+    std::string arg = argv[i];
+    if (arg == "-n" && i + 1 < argc) n = std::stoi(argv[++i]);
+    else files.push_back(argv[i]);
+  }
+
+  if (files.size() != 2){
+    std::cerr << "Usage: " << argv[0] << " [-n 10] paths.csv paths.graph\n";
+    return 1;
+  }
+
+  std::vector<Path> paths;
+  std::map<Key, Graph> graphs;
+  if (!read_paths(files[0], paths) || !read_graphs(files[1], graphs))
+    return 1;
+
+  std::map<Key, uint64_t> totals;
+  for (auto &p : paths)
+    totals[Key(p.function, p.file)] += p.count;
+
+  std::sort(paths.begin(), paths.end(), [](const Path &a, const Path &b){
+    return a.count > b.count;
+  });
+  if (paths.size() > n)
+    paths.resize(n);
+
+  std::cout << "FUNCTION,FILE,PATH,COUNT,SHARE,START,END,BLOCKS\n";
+  for (auto &p : paths){
+    Key key(p.function, p.file);
+    auto it = graphs.find(key);
+    if (it == graphs.end()){
+      std::cerr << "No graph for " << p.function << " in " << p.file << "\n";
+      continue;
+    }
+
+    std::ostringstream blocks;
+    if (!decode(it->second, p.id, blocks)){
+      std::cerr << "Cannot decode path " << p.id << " of " << p.function << "\n";
+      continue;
+    }
+
+    std::cout << p.function << "," << p.file << "," << p.id << "," << p.count
+              << "," << (double)p.count / totals[key] << "," << blocks.str()
+              << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,108 @@
+/*
+  Converts the branches.csv written by programs instrumented with
+  -instrument-branches into LLVM's text sample-profile format, so the
+  counts of a basilisk run can drive clang's profile-guided optimizations:
+
+    export_profile branches.csv > prof.txt
+    clang -O2 -g -fprofile-sample-use=prof.txt ...
+
+  Instrumentation profiles (-fprofile-instr-use) are keyed by the counter
+  layout and CFG hash of clang's own instrumentation, which we cannot
+  reproduce from IR counters. Sample profiles are keyed by function name
+  and line offset from the start of the function, which we do know.
+
+  For each function, the head count is its number of entries, and the
+  count of a line is the larger of the executions of the branches on that
+  line and the number of times an edge entered a block starting there.
+*/
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct Function {
+  unsigned long long head = 0;
+  std::map<int, unsigned long long> edges;    // offset -> times entered
+  std::map<int, unsigned long long> branches; // offset -> times executed
+};
+
+static std::vector<std::string> split(const std::string &line){
+  std::vector<std::string> fields;
+  std::stringstream ss(line);
+  std::string field;
+  while (std::getline(ss, field, ','))
+    fields.push_back(field);
+  return fields;
+}
+
+int main(int argc, char *argv[]){
+  if (argc != 2){
+    std::cerr << "Usage: " << argv[0] << " branches.csv\n";
+    return 1;
+  }
+
+  std::ifstream in(argv[1]);
+  if (!in){
+    std::cerr << "Cannot open " << argv[1] << "\n";
+    return 1;
+  }
+
+  std::map<std::string, Function> functions;
+
+  std::string line;
+  std::getline(in, line); // header
+
+  // FUNCTION,FILE,LINE,KIND,TARGET_LINE,FUNCTION_LINE,COUNT
+  while (std::getline(in, line)){
+    std::vector<std::string> fields = split(line);
+    if (fields.size() != 7)
+      continue;
+
+    int lineno = std::stoi(fields[2]);
+    int target = std::stoi(fields[4]);
+    int start = std::stoi(fields[5]);
+    unsigned long long count = std::stoull(fields[6]);
+
+    // Without debug info there are no offsets
+    if (start == 0)
+      continue;
+
+    Function &f = functions[fields[0]];
+    if (fields[3] == "entry"){
+      f.head += count;
+      f.edges[0] += count;
+      continue;
+    }
+
+    if (lineno >= start)
+      f.branches[lineno - start] += count;
+    if (target >= start)
+      f.edges[target - start] += count;
+  }
+
+  for (auto &it : functions){
+    Function &f = it.second;
+
+    std::map<int, unsigned long long> body = f.edges;
+    for (auto &b : f.branches)
+      if (b.second > body[b.first])
+        body[b.first] = b.second;
+
+    unsigned long long total = 0;
+    for (auto &b : body)
+      total += b.second;
+
+    if (total == 0)
+      continue;
+
+    std::cout << it.first << ":" << total << ":" << f.head << "\n";
+    for (auto &b : body)
+      if (b.second)
+        std::cout << " " << b.first << ": " << b.second << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,114 @@
+/*
+  Joins the per-line counts of the Instrument pass (lines.csv, written when
+  the pass runs with -instrument-lines) with the per-line counts of the
+  CountLines pin tool (pin_lines.csv), and prints, for each line and opcode
+  class, how many x86 instructions were executed per LLVM IR instruction.
+
+  Usage: join_lines lines.csv pin_lines.csv > ratios.csv
+*/
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+typedef std::tuple<std::string, int, std::string> Key;
+
+struct Counts {
+  unsigned long long ir = 0;
+  unsigned long long x86 = 0;
+};
+
+static std::vector<std::string> split(const std::string &line){
+  std::vector<std::string> fields;
+  std::stringstream ss(line);
+  std::string field;
+  while (std::getline(ss, field, ','))
+    fields.push_back(field);
+  return fields;
+}
+
+// Debug info in the IR and in the binary may disagree on the directory
+static std::string basename(const std::string &path){
+  size_t pos = path.find_last_of('/');
+  if (pos == std::string::npos)
+    return path;
+  return path.substr(pos + 1);
+}
+
+// Maps an LLVM IR opcode to the class used by the pin tools (see categories.H)
+static std::string ir_class(const std::string &opcode){
+  static const std::map<std::string, std::string> classes = {
+    {"store", "STORE"}, {"load", "LOAD"}, {"br", "BR"}, {"call", "CALL"},
+    {"icmp", "CMP"}, {"fcmp", "FCMP"},
+    {"add", "ADD"}, {"sub", "SUB"}, {"mul", "MUL"},
+    {"udiv", "DIV"}, {"sdiv", "DIV"}, {"urem", "DIV"}, {"srem", "DIV"},
+    {"fadd", "FADD"}, {"fsub", "FSUB"}, {"fmul", "FMUL"}, {"fdiv", "FDIV"},
+    {"and", "AND"}, {"or", "OR"}, {"xor", "XOR"},
+    {"shl", "SHL"}, {"ashr", "ASHR"}, {"lshr", "LSHR"},
+    {"select", "SELECT"}
+  };
+
+  auto it = classes.find(opcode);
+  if (it != classes.end())
+    return it->second;
+  return opcode;
+}
+
+static bool read_counts(const char *filename, bool ir,
+                        std::map<Key, Counts> &counts){
+  std::ifstream in(filename);
+  if (!in){
+    std::cerr << "Cannot open " << filename << "\n";
+    return false;
+  }
+
+  std::string line;
+  std::getline(in, line); // header
+
+  while (std::getline(in, line)){
+    std::vector<std::string> fields = split(line);
+    if (fields.size() != 4)
+      continue;
+
+    int lineno = std::stoi(fields[1]);
+    unsigned long long count = std::stoull(fields[3]);
+
+    if (ir){
+      Key k(basename(fields[0]), lineno, ir_class(fields[2]));
+      counts[k].ir += count;
+    }
+    else {
+      Key k(basename(fields[0]), lineno, fields[2]);
+      counts[k].x86 += count;
+    }
+  }
+
+  return true;
+}
+
+int main(int argc, char *argv[]){
+  if (argc != 3){
+    std::cerr << "Usage: " << argv[0] << " lines.csv pin_lines.csv\n";
+    return 1;
+  }
+
+  std::map<Key, Counts> counts;
+  if (!read_counts(argv[1], true, counts) || !read_counts(argv[2], false, counts))
+    return 1;
+
+  std::cout << "FILE,LINE,CLASS,IR,X86,RATIO\n";
+  for (auto &it : counts){
+    std::cout << std::get<0>(it.first) << ',' << std::get<1>(it.first) << ','
+              << std::get<2>(it.first) << ',' << it.second.ir << ','
+              << it.second.x86 << ',';
+    if (it.second.ir)
+      std::cout << (double)it.second.x86 / it.second.ir;
+    std::cout << '\n';
+  }
+
+  return 0;
+}
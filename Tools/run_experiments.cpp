@@ -0,0 +1,346 @@
+/*
+  Runs the benchmark x optimization level x tool matrix in parallel:
+
+    run_experiments -plugin build/Instrument/libInstrument.so
+                    -collect build/Collect/libCollect.a
+                    -pin $HOME/Programs/Pin/pin
+                    -pintool PinLib/obj-intel64/CountBinOps.so
+                    -j 8 -o results manifest.txt
+
+  Each line of the manifest describes a benchmark, with ';' between the
+  fields and '#' starting a comment:
+
+    NAME;SOURCES;FLAGS;ARGS
+
+  where SOURCES is a space-separated list of C files (relative to the
+  manifest), FLAGS are extra compiler flags and ARGS are the arguments of
+  the program. For every benchmark and level in -levels (0123 by default)
+  a build job compiles the program twice into results/NAME/O<level>: an
+  instrumented binary (clang -emit-llvm, llvm-link, opt -Instrument, linked
+  with Collect) and a native one for Pin. When it succeeds it schedules
+  two runs, each one in its own directory, so the CSV files written by the
+  runtime and by the Pin tools never collide:
+
+    results/NAME/O2/instrument/count.csv
+    results/NAME/O2/pin/binops.csv
+
+  The logs of the jobs are next to their outputs, and results/runs.csv
+  lists every job with its status and wall time.
+*/
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Benchmark {
+  std::string name;
+  std::vector<std::string> sources;
+  std::string flags;
+  std::string args;
+};
+
+struct Config {
+  std::string plugin;
+  std::string collect;
+  std::string pin;
+  std::string pintool;
+  std::string opt_flags;
+  std::string clang = "clang";
+  std::string llvm_link = "llvm-link";
+  std::string opt = "opt";
+  std::string levels = "0123";
+  std::string output = "results";
+  unsigned jobs = std::thread::hardware_concurrency();
+};
+
+struct Result {
+  std::string benchmark;
+  char level;
+  std::string job;
+  int status;
+  double seconds;
+};
+
+/*
+  A fixed set of workers taking jobs from a queue. A job may submit more
+  jobs; wait() returns when the queue is empty and every worker is idle.
+*/
+class Pool {
+  public:
+  Pool(unsigned n){
+    for (unsigned i=0; i<n; i++)
+      workers.emplace_back([this]{ work(); });
+  }
+
+  void submit(std::function<void()> job){
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push_back(job);
+    ++pending;
+    ready.notify_one();
+  }
+
+  void wait(){
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]{ return pending == 0; });
+    stop = true;
+    ready.notify_all();
+    lock.unlock();
+    for (auto &w : workers)
+      w.join();
+  }
+
+  private:
+  void work(){
+    while (true){
+      std::function<void()> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this]{ return stop || !queue.empty(); });
+        if (queue.empty())
+          return;
+        job = queue.front();
+        queue.pop_front();
+      }
+
+      job();
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--pending == 0)
+        done.notify_all();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()> > queue;
+  std::mutex mutex;
+  std::condition_variable ready, done;
+  unsigned pending = 0;
+  bool stop = false;
+};
+
+static std::mutex results_mutex;
+static std::vector<Result> results;
+
+static std::string quote(const std::string &s){
+  std::string q = "'";
+  for (char c : s){
+    if (c == '\'')
+      q += "'\\''";
+    else
+      q += c;
+  }
+  return q + "'";
+}
+
+static std::string trim(const std::string &s){
+  size_t b = s.find_first_not_of(" \t\r");
+  size_t e = s.find_last_not_of(" \t\r");
+  return b == std::string::npos ? "" : s.substr(b, e - b + 1);
+}
+
+static std::string dirname(const std::string &path){
+  size_t slash = path.rfind('/');
+  return slash == std::string::npos ? "." : path.substr(0, slash);
+}
+
+static std::string absolute(const std::string &path){
+  if (path.empty() || path[0] == '/')
+    return path;
+  const char *pwd = std::getenv("PWD");
+  return std::string(pwd ? pwd : ".") + "/" + path;
+}
+
+static bool read_manifest(const std::string &filename,
+    std::vector<Benchmark> &benchmarks){
+
+  std::ifstream in(filename);
+  if (!in){
+    std::cerr << "Cannot open " << filename << "\n";
+    return false;
+  }
+
+  std::string base = absolute(dirname(filename));
+  std::string line;
+  while (std::getline(in, line)){
+    line = trim(line.substr(0, line.find('#')));
+    if (line.empty())
+      continue;
+
+    std::vector<std::string> fields;
+    std::stringstream ss(line);
+    std::string field;
+    while (std::getline(ss, field, ';'))
+      fields.push_back(trim(field));
+    fields.resize(4);
+
+    Benchmark b;
+    b.name = fields[0];
+    std::stringstream sources(fields[1]);
+    std::string source;
+    while (sources >> source)
+      b.sources.push_back(source[0] == '/' ? source : base + "/" + source);
+    b.flags = fields[2];
+    b.args = fields[3];
+
+    if (b.name.empty() || b.sources.empty()){
+      std::cerr << "Ignoring malformed line: " << line << "\n";
+      continue;
+    }
+    benchmarks.push_back(b);
+  }
+
+  return true;
+}
+
+// Runs `command` in `dir`, appending its output to dir/<job>.log
+static void run(const Benchmark &b, char level, const std::string &job,
+    const std::string &dir, const std::string &command,
+    std::function<void()> next = nullptr){
+
+  auto start = std::chrono::steady_clock::now();
+  std::string line = "mkdir -p " + quote(dir) + " && cd " + quote(dir) +
+    " && (" + command + ") >> " + job + ".log 2>&1";
+  int status = std::system(line.c_str());
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+
+  {
+    std::lock_guard<std::mutex> lock(results_mutex);
+    results.push_back(Result{b.name, level, job, status, elapsed.count()});
+    std::cerr << (status ? "FAIL " : "ok   ") << b.name << " -O" << level
+              << " " << job << " (" << elapsed.count() << "s)\n";
+  }
+
+  if (status == 0 && next)
+    next();
+}
+
+static std::string build_command(const Config &c, const Benchmark &b,
+    char level){
+
+  std::string O = std::string("-O") + level;
+  // Keep the functions optimizable by opt at -O0
+  std::string keep = level == '0' ? " -Xclang -disable-O0-optnone" : "";
+
+  std::ostringstream cmd;
+  cmd << "rm -f *.bc";
+  for (unsigned i=0; i<b.sources.size(); i++)
+    cmd << " && " << c.clang << " " << O << keep << " -g -emit-llvm -c "
+        << b.flags << " " << quote(b.sources[i]) << " -o src" << i << ".bc";
+  cmd << " && " << c.llvm_link << " src*.bc -o " << b.name << ".bc"
+      << " && " << c.opt << " -load " << quote(c.plugin) << " -Instrument "
+      << c.opt_flags << " " << b.name << ".bc -o " << b.name << ".inst.bc"
+      << " && " << c.clang << " " << O << " " << b.name << ".inst.bc "
+      << quote(c.collect) << " -lm -ldl -o " << b.name << ".inst";
+
+  if (!c.pin.empty()){
+    cmd << " && " << c.clang << " " << O << " -g " << b.flags;
+    for (auto &s : b.sources)
+      cmd << " " << quote(s);
+    cmd << " -lm -o " << b.name;
+  }
+
+  return cmd.str();
+}
+
+static void usage(const char *argv0){
+  std::cerr << "Usage: " << argv0 << " -plugin libInstrument.so"
+            << " -collect libCollect.a [-pin pin -pintool tool.so]"
+            << " [-opt-flags flags] [-levels 0123] [-j jobs] [-o dir]"
+            << " [-clang clang] [-llvm-link llvm-link] [-opt opt]"
+            << " manifest\n";
+}
+
+int main(int argc, char *argv[]){
+  Config c;
+  std::string manifest;
+
+  for (int i=1; i<argc; i++){
+    std::string arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (arg == "-plugin" && has_value) c.plugin = argv[++i];
+    else if (arg == "-collect" && has_value) c.collect = argv[++i];
+    else if (arg == "-pin" && has_value) c.pin = argv[++i];
+    else if (arg == "-pintool" && has_value) c.pintool = argv[++i];
+    else if (arg == "-opt-flags" && has_value) c.opt_flags = argv[++i];
+    else if (arg == "-levels" && has_value) c.levels = argv[++i];
+    else if (arg == "-j" && has_value) c.jobs = std::stoi(argv[++i]);
+    else if (arg == "-o" && has_value) c.output = argv[++i];
+    else if (arg == "-clang" && has_value) c.clang = argv[++i];
+    else if (arg == "-llvm-link" && has_value) c.llvm_link = argv[++i];
+    else if (arg == "-opt" && has_value) c.opt = argv[++i];
+    else if (manifest.empty() && arg[0] != '-') manifest = arg;
+    else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (manifest.empty() || c.plugin.empty() || c.collect.empty() ||
+      c.pin.empty() != c.pintool.empty()){
+    usage(argv[0]);
+    return 1;
+  }
+
+  c.plugin = absolute(c.plugin);
+  c.collect = absolute(c.collect);
+  c.pintool = absolute(c.pintool);
+  c.output = absolute(c.output);
+  if (c.jobs == 0)
+    c.jobs = 1;
+
+  std::vector<Benchmark> benchmarks;
+  if (!read_manifest(manifest, benchmarks))
+    return 1;
+
+  std::system(("mkdir -p " + quote(c.output)).c_str());
+
+  Pool pool(c.jobs);
+
+  for (auto &b : benchmarks){
+    for (char level : c.levels){
+      std::string dir = c.output + "/" + b.name + "/O" + level;
+      std::string build = dir + "/build";
+
+      pool.submit([&c, &b, &pool, level, dir, build]{
+        run(b, level, "build", build, build_command(c, b, level), [&]{
+          pool.submit([&b, level, dir, build]{
+            run(b, level, "instrument", dir + "/instrument",
+                quote(build + "/" + b.name + ".inst") + " " + b.args);
+          });
+
+          if (c.pin.empty())
+            return;
+
+          pool.submit([&c, &b, level, dir, build]{
+            run(b, level, "pin", dir + "/pin",
+                quote(c.pin) + " -t " + quote(c.pintool) + " -- " +
+                quote(build + "/" + b.name) + " " + b.args);
+          });
+        });
+      });
+    }
+  }
+
+  pool.wait();
+
+  std::ofstream out(c.output + "/runs.csv");
+  out << "BENCHMARK,LEVEL,JOB,STATUS,SECONDS\n";
+  int failed = 0;
+  for (auto &r : results){
+    out << r.benchmark << ",O" << r.level << "," << r.job << ","
+        << (r.status ? "FAIL" : "ok") << "," << r.seconds << "\n";
+    failed += r.status != 0;
+  }
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,211 @@
+/*
+  Chooses simulation points from the basic-block vectors written by the
+  BBV Pin tool:
+
+    pin -t obj-intel64/BBV.so -interval 100000000 -- ./program
+    simpoint -k 10 bbv.bin > simpoints.csv
+    pin -t obj-intel64/CountBinOps.so -simpoints simpoints.csv
+        -interval 100000000 -- ./program
+
+  As in SimPoint, each vector is normalized by the length of its interval
+  and randomly projected to a few dimensions, and the intervals are
+  grouped with k-means (k-means++ seeding, fixed seed). For every cluster
+  the interval closest to the centroid is written, with the fraction of
+  the executed instructions in the cluster (WEIGHT) and the number of
+  intervals it stands for (MULTIPLIER), which the Pin tools use to
+  extrapolate their counts.
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+typedef std::vector<double> Point;
+
+struct Interval {
+  uint64_t instructions;
+  std::vector<std::pair<uint32_t, uint64_t> > blocks;
+};
+
+template<class T> static bool get(std::ifstream &in, T &value){
+  return (bool)in.read((char*)&value, sizeof(T));
+}
+
+static bool read_bbv(const char *filename, std::vector<Interval> &intervals){
+  std::ifstream in(filename, std::ios::binary);
+  char magic[4];
+  uint64_t size;
+  if (!in.read(magic, 4) || std::memcmp(magic, "BBV1", 4) || !get(in, size)){
+    std::cerr << "Cannot read " << filename << "\n";
+    return false;
+  }
+
+  Interval interval;
+  uint32_t n;
+  while (get(in, interval.instructions) && get(in, n)){
+    interval.blocks.resize(n);
+    for (uint32_t i=0; i<n; i++)
+      if (!get(in, interval.blocks[i].first) || !get(in, interval.blocks[i].second))
+        return false;
+    intervals.push_back(interval);
+  }
+
+  return true;
+}
+
+static double distance(const Point &a, const Point &b){
+  double d = 0;
+  for (size_t i=0; i<a.size(); i++)
+    d += (a[i] - b[i]) * (a[i] - b[i]);
+  return d;
+}
+
+static Point project(const Interval &interval, unsigned dims, unsigned seed,
+    std::map<uint32_t, Point> &projection){
+
+  Point p(dims, 0.0);
+  for (auto &b : interval.blocks){
+    Point &r = projection[b.first];
+    if (r.empty()){
+      // The same random direction for a block in every run
+      std::mt19937 gen(seed ^ (b.first * 2654435761u));
+      std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+      for (unsigned d=0; d<dims; d++)
+        r.push_back(uniform(gen));
+    }
+    double weight = (double)b.second / interval.instructions;
+    for (unsigned d=0; d<dims; d++)
+      p[d] += weight * r[d];
+  }
+  return p;
+}
+
+static std::vector<unsigned> kmeans(const std::vector<Point> &points,
+    unsigned k, unsigned iterations, unsigned seed, std::vector<Point> &centers){
+
+  std::mt19937 gen(seed);
+
+  // k-means++: each new center is drawn with probability D(x)^2
+  centers.clear();
+  centers.push_back(points[std::uniform_int_distribution<size_t>(0,
+    points.size() - 1)(gen)]);
+  std::vector<double> nearest(points.size(), std::numeric_limits<double>::max());
+  while (centers.size() < k){
+    double total = 0;
+    for (size_t i=0; i<points.size(); i++){
+      nearest[i] = std::min(nearest[i], distance(points[i], centers.back()));
+      total += nearest[i];
+    }
+    if (total == 0)
+      break;
+
+    double r = std::uniform_real_distribution<double>(0, total)(gen);
+    size_t i = 0;
+    for (; i + 1 < points.size() && r > nearest[i]; i++)
+      r -= nearest[i];
+    centers.push_back(points[i]);
+  }
+
+  std::vector<unsigned> cluster(points.size(), 0);
+  for (unsigned it=0; it<iterations; it++){
+    bool changed = false;
+    for (size_t i=0; i<points.size(); i++){
+      unsigned best = 0;
+      for (unsigned c=1; c<centers.size(); c++)
+        if (distance(points[i], centers[c]) < distance(points[i], centers[best]))
+          best = c;
+      changed |= best != cluster[i];
+      cluster[i] = best;
+    }
+    if (!changed && it > 0)
+      break;
+
+    std::vector<unsigned> sizes(centers.size(), 0);
+    for (auto &c : centers)
+      c.assign(c.size(), 0.0);
+    for (size_t i=0; i<points.size(); i++){
+      ++sizes[cluster[i]];
+      for (size_t d=0; d<points[i].size(); d++)
+        centers[cluster[i]][d] += points[i][d];
+    }
+    for (unsigned c=0; c<centers.size(); c++)
+      for (auto &x : centers[c])
+        x = sizes[c] ? x / sizes[c] : 0.0;
+  }
+
+  return cluster;
+}
+
+int main(int argc, char *argv[]){
+  unsigned k = 10, dims = 15, iterations = 100, seed = 493575226;
+  const char *filename = nullptr;
+
+  for (int i=1; i<argc; i++){
+    std::string arg = argv[i];
+    if (arg == "-k" && i + 1 < argc) k = std::stoi(argv[++i]);
+    else if (arg == "-dims" && i + 1 < argc) dims = std::stoi(argv[++i]);
+    else if (arg == "-iterations" && i + 1 < argc) iterations = std::stoi(argv[++i]);
+    else if (arg == "-seed" && i + 1 < argc) seed = std::stoul(argv[++i]);
+    else if (!filename) filename = argv[i];
+    else filename = nullptr, i = argc;
+  }
+
+  if (!filename || k == 0 || dims == 0){
+    std::cerr << "Usage: " << argv[0]
+              << " [-k 10] [-dims 15] [-iterations 100] [-seed n] bbv.bin\n";
+    return 1;
+  }
+
+  std::vector<Interval> intervals;
+  if (!read_bbv(filename, intervals))
+    return 1;
+
+  std::cout << "INTERVAL,CLUSTER,WEIGHT,MULTIPLIER\n";
+  if (intervals.empty())
+    return 0;
+
+  std::map<uint32_t, Point> projection;
+  std::vector<Point> points;
+  uint64_t total = 0;
+  for (auto &interval : intervals){
+    points.push_back(project(interval, dims, seed, projection));
+    total += interval.instructions;
+  }
+
+  if (k > points.size())
+    k = points.size();
+
+  std::vector<Point> centers;
+  std::vector<unsigned> cluster = kmeans(points, k, iterations, seed, centers);
+
+  std::vector<size_t> representative(centers.size(), points.size());
+  std::vector<uint64_t> instructions(centers.size(), 0), sizes(centers.size(), 0);
+  for (size_t i=0; i<points.size(); i++){
+    unsigned c = cluster[i];
+    instructions[c] += intervals[i].instructions;
+    ++sizes[c];
+    if (representative[c] == points.size() ||
+        distance(points[i], centers[c]) <
+        distance(points[representative[c]], centers[c]))
+      representative[c] = i;
+  }
+
+  std::map<size_t, unsigned> chosen;
+  for (unsigned c=0; c<centers.size(); c++)
+    if (sizes[c])
+      chosen[representative[c]] = c;
+
+  for (auto &it : chosen){
+    unsigned c = it.second;
+    std::cout << it.first << "," << c << ","
+              << (double)instructions[c] / total << "," << sizes[c] << "\n";
+  }
+
+  return 0;
+}